@@ -0,0 +1,102 @@
+/*
+ * SdReaderHost.cpp
+ *
+ * SdReader for host builds.  Blocks come from a disk image file instead
+ * of the SPI bus, and each byte that would cross the bus costs the same
+ * virtual time it takes on the part, so interrupts fire in the middle of
+ * reads just as they do on the plunger.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ */
+
+#include <stdio.h>
+#include "WProgram.h"
+#include "SdReader.h"
+#include "SdReaderHost.h"
+
+// Defaults: 8 MHz SPI (16 cycles a byte plus loop overhead) and a typical
+// card's access time for CMD17.
+uint32_t sim_sd_byte_cycles = 20;
+uint32_t sim_sd_command_cycles = SIM_CYCLES(300);
+struct sim_sd_stats sim_sd_stats;
+
+static FILE *image = 0;
+static uint8_t block_data[512];
+
+uint8_t sim_sd_open(const char *path) {
+  image = fopen(path, "rb");
+  return image != 0;
+}
+
+uint8_t SdReader::init(uint8_t) {
+  busyFunc_ = 0;
+  inBlock_ = 0;
+  type(SD_CARD_TYPE_SD2);
+  if (!image) {
+    error(SD_CARD_ERROR_CMD0);
+    return 0;
+  }
+  return 1;
+}
+
+#if SD_CARD_INFO_SUPPORT
+uint32_t SdReader::cardSize(void) {
+  if (!image) return 0;
+  fseek(image, 0, SEEK_END);
+  return ftell(image) / 512;
+}
+
+uint8_t SdReader::readRegister(uint8_t, uint8_t *) {
+  error(SD_CARD_ERROR_READ_REG);
+  return 0;
+}
+#endif  // SD_CARD_INFO_SUPPORT
+
+uint8_t SdReader::readData(uint32_t block, uint16_t offset, uint8_t *dst,
+                           uint16_t count) {
+  if (count == 0) return 1;
+  if ((count + offset) > 512) {
+    return 0;
+  }
+  if (!inBlock_ || block != block_ || offset < offset_) {
+    readEnd();
+    block_ = block;
+    sim_sd_stats.commands++;
+    sim_advance(sim_sd_command_cycles);
+    memset(block_data, 0, sizeof(block_data));
+    if (fseek(image, (long)block * 512, SEEK_SET)
+        || fread(block_data, 1, 512, image) != 512) {
+      error(SD_CARD_ERROR_READ, 0);
+      return 0;
+    }
+    offset_ = 0;
+    inBlock_ = 1;
+  }
+  // skip data before offset
+  for (; offset_ < offset; offset_++) {
+    sim_sd_stats.bytes++;
+    sim_advance(sim_sd_byte_cycles);
+  }
+  for (uint16_t i = 0; i < count; i++) {
+    dst[i] = block_data[offset_ + i];
+    sim_sd_stats.bytes++;
+    sim_advance(sim_sd_byte_cycles);
+  }
+  offset_ += count;
+  if (!partialBlockRead_ || offset_ >= 512) readEnd();
+  return 1;
+}
+
+void SdReader::readEnd(void) {
+  if (inBlock_) {
+    // skip data and crc
+    while (offset_++ < 514) {
+      sim_sd_stats.bytes++;
+      sim_advance(sim_sd_byte_cycles);
+    }
+    inBlock_ = 0;
+  }
+}
@@ -0,0 +1,30 @@
+/*
+ * SdReaderHost.h
+ *
+ * Controls for the image-backed SdReader used in host builds.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ */
+
+#ifndef SdReaderHost_h
+#define SdReaderHost_h
+
+#include <stdint.h>
+
+// Open the disk image that SdReader::init() will find in the slot.
+uint8_t sim_sd_open(const char *path);
+
+// Virtual time for one byte over SPI and for a CMD17 to return data
+extern uint32_t sim_sd_byte_cycles;
+extern uint32_t sim_sd_command_cycles;
+
+struct sim_sd_stats {
+  uint32_t commands;  // block reads started
+  uint32_t bytes;     // bytes clocked over the bus, including skips
+};
+extern struct sim_sd_stats sim_sd_stats;
+
+#endif  // SdReaderHost_h
@@ -0,0 +1,70 @@
+/*
+ * Host stand-in for the Arduino 0017 core, implemented in sim.cpp.
+ */
+#ifndef WProgram_h
+#define WProgram_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+typedef uint8_t boolean;
+typedef uint8_t byte;
+
+#define noInterrupts() cli()
+#define interrupts() sei()
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void randomSeed(unsigned int seed);
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+// Serial output goes to stdout unless sim_serial_quiet is set.
+class HardwareSerial {
+ public:
+  void begin(long) {}
+  int available(void);
+  int read(void);
+  void print(const char *s);
+  void print(char c);
+  void print(uint8_t b);
+  void print(int n, int base = DEC);
+  void print(unsigned int n, int base = DEC);
+  void print(long n, int base = DEC);
+  void print(unsigned long n, int base = DEC);
+  void println(void);
+  void println(const char *s);
+  void println(char c);
+  void println(uint8_t b);
+  void println(int n, int base = DEC);
+  void println(unsigned int n, int base = DEC);
+  void println(long n, int base = DEC);
+  void println(unsigned long n, int base = DEC);
+};
+
+extern HardwareSerial Serial;
+extern uint8_t sim_serial_quiet;
+// Characters returned by Serial.read(), if any
+extern const char *sim_serial_input;
+
+#endif  // WProgram_h
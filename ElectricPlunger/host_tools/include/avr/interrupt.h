@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for <avr/interrupt.h>.  Interrupt handlers become plain
+ * functions that a harness calls from its dispatch function.
+ */
+#ifndef sim_avr_interrupt_h
+#define sim_avr_interrupt_h
+
+void cli(void);
+void sei(void);
+
+#define SIGNAL(vector) extern "C" void vector(void); extern "C" void vector(void)
+#define ISR(vector) SIGNAL(vector)
+
+#endif  // sim_avr_interrupt_h
@@ -0,0 +1,140 @@
+/*
+ * Host stand-in for <avr/io.h> on the ATmega328P.  Registers are SimReg
+ * objects defined in sim.cpp.
+ */
+#ifndef sim_avr_io_h
+#define sim_avr_io_h
+
+#include "../../sim.h"
+
+#define _BV(bit) (1 << (bit))
+
+extern SimReg8 PINB, DDRB, PORTB;
+extern SimReg8 PINC, DDRC, PORTC;
+extern SimReg8 PIND, DDRD, PORTD;
+extern SimReg8 TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+extern SimReg8 TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern SimReg16 TCNT1, OCR1A, OCR1B, ICR1;
+extern SimReg8 TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR;
+extern SimReg8 GTCCR, SPCR, SPSR, SPDR, SREG;
+
+// port bits
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PIND0 0
+#define PIND1 1
+#define PIND2 2
+#define PIND3 3
+#define PIND4 4
+#define PIND5 5
+#define PIND6 6
+#define PIND7 7
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTD0 0
+#define PORTD1 1
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PORTD7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define DDB0 0
+#define DDB3 3
+#define DDD3 3
+#define DDD6 6
+#define DDD7 7
+
+// timer 0
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+// timer 1
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+
+// timer 2
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+
+#define PSRSYNC 0
+#define PSRASY 1
+#define TSM 7
+
+// spi
+#define SPR0 0
+#define SPR1 1
+#define MSTR 4
+#define SPE 6
+#define SPI2X 0
+#define SPIF 7
+
+// status register
+#define SREG_I 7
+
+#endif  // sim_avr_io_h
@@ -0,0 +1,12 @@
+/* Host stand-in for <avr/pgmspace.h>.  Program memory is ordinary memory. */
+#ifndef sim_avr_pgmspace_h
+#define sim_avr_pgmspace_h
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+#endif  // sim_avr_pgmspace_h
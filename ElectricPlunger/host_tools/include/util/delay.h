@@ -0,0 +1,10 @@
+/* Host stand-in for <util/delay.h> */
+#ifndef sim_util_delay_h
+#define sim_util_delay_h
+
+#include "../../sim.h"
+
+#define _delay_us(us) sim_advance(SIM_CYCLES(us))
+#define _delay_ms(ms) sim_advance(SIM_CYCLES((ms) * 1000UL))
+
+#endif  // sim_util_delay_h
@@ -0,0 +1,2 @@
+/* Host stand-in for the Arduino core header */
+#include "WProgram.h"
@@ -0,0 +1,880 @@
+/*
+ * ledsim.cpp
+ *
+ * Host-side refresh harness for the LedMatrix library.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * Drives the unmodified LedMatrix sources on the simulated AVR and watches
+ * the pins the way the 74HC595s do.  Bits are shifted in on each rising
+ * edge of the clock, and since the board ties the storage clock to the
+ * shift clock, the outputs take the shift register's previous contents on
+ * the same edge (hence the extra clock at the end of each shift-out).  The
+ * output enable is read off the port, or off timer 0 when the library
+ * hands the pin to its PWM.  Timer2's compare A interrupt runs in virtual
+ * time for the timer refresh.
+ *
+ * From the outputs the harness works out when each LED is lit and reports
+ * its duty cycle, how often it is refreshed and the longest time it goes
+ * dark while it should be showing, under a main loop that can stall the
+ * way an SD transfer does.
+ *
+ * USAGE:
+ *
+ *   ledsim [options] PATTERN|file.led|FILE.LEB
+ *
+ *   PATTERN is 60 digits as passed to DisplayLeds(), shown for the whole
+ *   run.  A .led file is played line by line, effects included, as the
+ *   plunger does.  A .LEB file from mkleb is decoded with LedShowDecode(),
+ *   as the plunger does, and played the same way.
+ *
+ *   -B n      brightness, 0 to 255 (default 255)
+ *   -b us     call RunStateMachineFromInterrupt() this often during a
+ *             stall, as the SD busy hooks do (default 0, never)
+ *   -d        put the matrix on pins 2, 3 and 4 so it shifts out with
+ *             digitalWrite()
+ *   -F file   write each frame passed to the matrix: its time in ms and
+ *             the level of each LED in hex.  A frame the same as the one
+ *             before is left out, as mkleb merges those, so a .led file
+ *             and its .LEB give the same list.
+ *   -G us     exit 1 if any LED goes dark for longer than this
+ *   -g us     dark times shorter than this are within one visit to the
+ *             row (default half a row's time)
+ *   -i        mask interrupts during stalls
+ *   -k mode   row skipping: off, even or fast (default even)
+ *   -l        refresh from RunStateMachine() instead of Timer2
+ *   -p us     main loop work between RunStateMachine() calls (default 100)
+ *   -R hz     exit 1 if any lit LED is refreshed less often than this
+ *   -S ms     time between stalls (default 0, no stalls)
+ *   -s us     length of each stall (default 5000)
+ *   -T file   write a CSV trace of every change to the outputs
+ *   -t ms     length of the run (default 1000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "WProgram.h"
+#include "LedMatrix.h"
+#include "LedEffect.h"
+#include "LedShow.h"
+#include "sim.h"
+
+extern "C" void TIMER2_COMPA_vect(void);
+
+// Cost of entering and leaving an interrupt handler, register saves
+// included.  Port accesses inside the handler are counted as they happen.
+#define ISR_OVERHEAD_CYCLES 60
+
+#define ROWS LED_NUM_ROWS
+#define COLS LED_NUM_COLS
+#define NUM_LEDS (ROWS * COLS)
+
+// Pins for -d, which don't match the fast shift-out pins
+#define SLOW_DATA_PIN 2
+#define SLOW_CLOCK_PIN 3
+#define SLOW_OE_PIN 4
+
+// The way the outputs are enabled
+#define OUT_OFF 0
+#define OUT_ON  1
+#define OUT_PWM 2
+
+static uint64_t loop_period = SIM_CYCLES(100);
+static uint64_t stall_period = 0;
+static uint64_t stall_length = SIM_CYCLES(5000);
+static uint64_t busy_period = 0;
+static uint8_t stall_masked = 0;
+static uint64_t merge_gap = SIM_CYCLES(LED_SCAN_US / ROWS / 2);
+static FILE *trace = 0;
+static FILE *frame_list = 0;
+
+/***********************************************************
+ *  Statistics
+ ***********************************************************/
+
+struct span_stats {
+  uint32_t count;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+static void span_add(struct span_stats *s, uint64_t cycles) {
+  if (s->count == 0 || cycles < s->min) s->min = cycles;
+  if (cycles > s->max) s->max = cycles;
+  s->total += cycles;
+  s->count++;
+}
+
+static void span_print(const char *name, struct span_stats *s) {
+  if (s->count == 0) {
+    printf("%-18s none\n", name);
+    return;
+  }
+  printf("%-18s %lu, min/mean/max %llu/%llu/%llu us\n", name,
+         (unsigned long)s->count,
+         (unsigned long long)SIM_US(s->min),
+         (unsigned long long)SIM_US(s->total / s->count),
+         (unsigned long long)SIM_US(s->max));
+}
+
+static struct span_stats isr_stats;
+static struct span_stats isr_latency;
+static struct span_stats poll_latency;
+static struct span_stats stall_stats;
+
+/*
+ * What is known about each LED.  A dark time only counts as a gap if the
+ * latest frame passed to the matrix had the LED lit all the while.
+ */
+struct led_stats {
+  uint64_t on_cycles;       // time lit, scaled by the PWM duty
+  uint64_t shown_cycles;    // time the latest frame had it lit
+  uint64_t dark_since;
+  uint64_t max_gap;
+  uint64_t max_gap_at;
+  uint32_t visits;
+  uint32_t off_frames;      // frames passed in with it off
+  uint32_t off_frames_at_dark;
+  uint8_t level_at_dark;
+  uint8_t lit;
+  uint8_t ever_lit;
+  uint8_t level;            // in the latest frame
+};
+
+static struct led_stats leds[NUM_LEDS];
+static uint64_t levels_since;
+
+/***********************************************************
+ *  Timer 0 PWM
+ ***********************************************************/
+
+// Timer 0 as init() sets it up: fast PWM at clk/64, 256 counts
+#define T0_TICK 64
+#define T0_PERIOD (256 * T0_TICK)
+
+/* Cycles in [0, t) that inverted PWM holds the pin low: count <= ocr */
+static uint64_t pwm_low_before(uint64_t t, uint8_t ocr) {
+  uint64_t width = (uint64_t)(ocr + 1) * T0_TICK;
+  uint64_t phase = t % T0_PERIOD;
+  return t / T0_PERIOD * width + (phase < width ? phase : width);
+}
+
+/***********************************************************
+ *  Shift registers and LEDs
+ ***********************************************************/
+
+static uint8_t data_pin, clock_pin, oe_pin;
+static uint8_t data_level, clock_level, oe_level = HIGH;
+static uint16_t shift_reg, storage_reg;
+static uint32_t latches;
+
+static uint16_t out_word;
+static uint8_t out_mode = OUT_OFF;
+static uint8_t out_ocr;
+static uint64_t out_since;
+
+static uint8_t current_mode(void) {
+  uint8_t com = TCCR0A.value & (_BV(COM0A1) | _BV(COM0A0));
+  if (oe_pin == LED_OE_PWM_PIN && com == (_BV(COM0A1) | _BV(COM0A0))) {
+    return OUT_PWM;
+  }
+  return oe_level ? OUT_OFF : OUT_ON;
+}
+
+/* Row i is selected by a low bit i, column j by a high bit above them. */
+static uint8_t led_lit(int led, uint16_t word, uint8_t mode) {
+  int row = led / COLS;
+  int col = led % COLS;
+  return mode != OUT_OFF && !(word & (1 << row))
+      && (word & (1 << (ROWS + COLS - 1 - col)));
+}
+
+/* Charge the time since the last change to the LEDs that were lit. */
+static void account(void) {
+  uint64_t now = sim_cycles;
+  uint64_t lit = 0;
+  if (out_mode == OUT_ON) {
+    lit = now - out_since;
+  } else if (out_mode == OUT_PWM) {
+    lit = pwm_low_before(now, out_ocr) - pwm_low_before(out_since, out_ocr);
+  }
+  if (lit) {
+    for (int led = 0; led < NUM_LEDS; led++) {
+      if (leds[led].lit) leds[led].on_cycles += lit;
+    }
+  }
+  out_since = now;
+}
+
+static void dark_gap_end(int led, uint64_t now) {
+  struct led_stats *s = &leds[led];
+  if (!s->ever_lit || s->off_frames != s->off_frames_at_dark
+      || !s->level_at_dark || !s->level) {
+    return;
+  }
+  uint64_t gap = now - s->dark_since;
+  if (gap > s->max_gap) {
+    s->max_gap = gap;
+    s->max_gap_at = s->dark_since;
+  }
+}
+
+/* Called whenever anything that decides the outputs may have changed. */
+static void outputs_changed(void) {
+  uint8_t mode = current_mode();
+  uint8_t ocr = OCR0A.value;
+  if (storage_reg == out_word && mode == out_mode
+      && (mode != OUT_PWM || ocr == out_ocr)) {
+    return;
+  }
+  account();
+  out_word = storage_reg;
+  out_mode = mode;
+  out_ocr = ocr;
+  uint64_t now = sim_cycles;
+  for (int led = 0; led < NUM_LEDS; led++) {
+    struct led_stats *s = &leds[led];
+    uint8_t lit = led_lit(led, out_word, out_mode);
+    if (lit == s->lit) continue;
+    s->lit = lit;
+    if (lit) {
+      if (!s->ever_lit || now - s->dark_since >= merge_gap) s->visits++;
+      dark_gap_end(led, now);
+      s->ever_lit = 1;
+    } else {
+      s->dark_since = now;
+      s->off_frames_at_dark = s->off_frames;
+      s->level_at_dark = s->level;
+    }
+  }
+  if (trace) {
+    fprintf(trace, "%llu,%04X,%s,%u\n", (unsigned long long)SIM_US(now),
+            out_word, mode == OUT_OFF ? "off" : mode == OUT_ON ? "on" : "pwm",
+            mode == OUT_PWM ? ocr : 255);
+  }
+}
+
+static void pin_changed(uint8_t pin, uint8_t value) {
+  value = value ? HIGH : LOW;
+  if (pin == data_pin) {
+    data_level = value;
+  } else if (pin == clock_pin) {
+    if (value && !clock_level) {
+      storage_reg = shift_reg;
+      shift_reg = (shift_reg << 1) | data_level;
+      latches++;
+      clock_level = value;
+      outputs_changed();
+    }
+    clock_level = value;
+  } else if (pin == oe_pin) {
+    oe_level = value;
+    outputs_changed();
+  }
+}
+
+static void portd_write(uint8_t old_value, uint8_t value) {
+  uint8_t changed = old_value ^ value;
+  if (changed & _BV(LED_DATA_BIT)) {
+    pin_changed(LED_DATA_PIN, value & _BV(LED_DATA_BIT));
+  }
+  if (changed & _BV(LED_OE_BIT)) {
+    pin_changed(LED_OE_PIN, value & _BV(LED_OE_BIT));
+  }
+}
+
+static void portb_write(uint8_t old_value, uint8_t value) {
+  if ((old_value ^ value) & _BV(LED_CLOCK_BIT)) {
+    pin_changed(LED_CLOCK_PIN, value & _BV(LED_CLOCK_BIT));
+  }
+}
+
+static void timer0_write(uint8_t, uint8_t) {
+  outputs_changed();
+}
+
+/***********************************************************
+ *  TIMER2
+ ***********************************************************/
+
+static LedMatrix *matrix;
+
+static uint8_t timer2_running;
+static uint64_t t2_time;        // start of the tick t2_count is in
+static uint8_t t2_count;
+static uint8_t t2_flag;
+static uint64_t t2_match_time;
+static uint8_t in_isr;
+static uint32_t t2_polled;
+
+#define T2_TICK 64
+
+/*
+ * Bring the counter up to date, counting with the given TOP.  In CTC mode
+ * the counter clears on the tick after it matches OCR2A.  If OCR2A is set
+ * below the count, it runs on through 255 first.
+ */
+static void timer2_sync(uint8_t top) {
+  if (!timer2_running) return;
+  uint64_t ticks = (sim_cycles - t2_time) / T2_TICK;
+  while (ticks) {
+    uint64_t step;
+    if (t2_count == top) {
+      t2_count = 0;
+      step = 1;
+    } else {
+      uint64_t end = t2_count < top ? top : 256;
+      step = end - t2_count;
+      if (step > ticks) step = ticks;
+      t2_count = (t2_count + step) & 0XFF;
+    }
+    ticks -= step;
+    t2_time += step * T2_TICK;
+    if (t2_count == top && !t2_flag) {
+      t2_flag = 1;
+      t2_match_time = t2_time;
+    }
+  }
+}
+
+static void tccr2b_write(uint8_t, uint8_t value) {
+  if ((value & 7) && !timer2_running) {
+    timer2_running = 1;
+    t2_time = sim_cycles;
+    t2_count = TCNT2.value;
+  } else if (!(value & 7)) {
+    timer2_sync(OCR2A.value);
+    timer2_running = 0;
+  }
+}
+
+static uint8_t tcnt2_read(void) {
+  timer2_sync(OCR2A.value);
+  return timer2_running ? t2_count : TCNT2.value;
+}
+
+static void tcnt2_write(uint8_t, uint8_t value) {
+  timer2_sync(OCR2A.value);
+  t2_count = value;
+}
+
+static void ocr2a_write(uint8_t old_value, uint8_t) {
+  timer2_sync(old_value);
+}
+
+static uint8_t tifr2_read(void) {
+  timer2_sync(OCR2A.value);
+  return t2_flag ? _BV(OCF2A) : 0;
+}
+
+/* Writing a one clears the flag.  Outside the handler that is a poll. */
+static void tifr2_write(uint8_t, uint8_t value) {
+  if ((value & _BV(OCF2A)) && t2_flag) {
+    t2_flag = 0;
+    if (!in_isr) {
+      t2_polled++;
+      span_add(&poll_latency, sim_cycles - t2_match_time);
+    }
+  }
+}
+
+static void dispatch(void) {
+  while (sim_interrupts_enabled && timer2_running && !in_isr) {
+    timer2_sync(OCR2A.value);
+    if (!t2_flag || !(TIMSK2.value & _BV(OCIE2A))) break;
+    t2_flag = 0;
+    uint64_t start = sim_cycles;
+    span_add(&isr_latency, start - t2_match_time);
+    in_isr = 1;
+    sim_interrupts_enabled = 0;
+    sim_cycles += ISR_OVERHEAD_CYCLES / 2;
+    TIMER2_COMPA_vect();
+    sim_cycles += ISR_OVERHEAD_CYCLES / 2;
+    sim_interrupts_enabled = 1;  // reti
+    in_isr = 0;
+    span_add(&isr_stats, sim_cycles - start);
+  }
+}
+
+/***********************************************************
+ *  Frames
+ ***********************************************************/
+
+static std::vector<LedShowEntry> lines;
+static uint32_t frames_passed;
+static uint64_t run_start;
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: ledsim [-B brightness] [-b us] [-d] [-G us] [-g us] [-i]"
+          " [-k off|even|fast] [-l] [-p us] [-R hz] [-S ms] [-s us]"
+          " [-T trace.csv] [-t ms] [-F frames.txt]"
+          " PATTERN|file.led|FILE.LEB\n");
+  exit(2);
+}
+
+static void fail(const char *msg) {
+  fprintf(stderr, "ledsim: %s\n", msg);
+  exit(1);
+}
+
+static int is_pattern(const char *s) {
+  if (strlen(s) != NUM_LEDS) return 0;
+  for (; *s; s++) {
+    if (*s < '0' || *s > '9') return 0;
+  }
+  return 1;
+}
+
+/*
+ * Each line is 4 digits of milliseconds, then 60 digits of LEDs or an
+ * effect.
+ */
+static void read_led_file(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) fail("can't open .led file");
+  char buf[256];
+  while (fgets(buf, sizeof(buf), f)) {
+    size_t len = strcspn(buf, "\r\n");
+    if (len == 0) continue;
+    buf[len] = 0;
+    LedShowEntry line;
+    line.is_effect = len == 4 + NUM_LEDS && line.effect.Parse(buf + 4);
+    if (len != 4 + NUM_LEDS || (!line.is_effect && !is_pattern(buf + 4))) {
+      fail("bad line in .led file");
+    }
+    if (!line.is_effect) {
+      LedMatrix::PackFrame(buf + 4, &line.frame);
+    }
+    line.duration = (unsigned)atoi(std::string(buf, 4).c_str());
+    lines.push_back(line);
+  }
+  fclose(f);
+  if (lines.empty()) fail("no lines in .led file");
+}
+
+/* Decode the record at data[pos] onto the end of lines, see LedShow.h. */
+static size_t read_show_record(const std::vector<uint8_t> &data, size_t pos,
+                               size_t end) {
+  unsigned char n = end - pos < LED_SHOW_HEAD_SIZE
+      ? end - pos : LED_SHOW_HEAD_SIZE;
+  unsigned char size = LedShowRecordSize(&data[pos], n);
+  if (!size || size > end - pos || data[pos] == LED_SHOW_LOOP) {
+    fail("bad record in .LEB file");
+  }
+  LedShowEntry blank;
+  memset(&blank, 0, sizeof(blank));
+  LedShowEntry entry;
+  if (!LedShowDecode(&data[pos], lines.empty() ? &blank : &lines.back(),
+                     &entry)) {
+    fail("record in .LEB file can't be shown");
+  }
+  lines.push_back(entry);
+  return size;
+}
+
+/*
+ * Decode a whole .LEB file into lines.  A loop's records are decoded
+ * again for each play, each from the one before it, as the plunger
+ * replays them from its stream.
+ */
+static void read_show_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) fail("can't open .LEB file");
+  std::vector<uint8_t> data;
+  int c;
+  while ((c = getc(f)) != EOF) data.push_back(c);
+  fclose(f);
+  if (data.size() < LED_SHOW_HEADER_SIZE
+      || memcmp(&data[0], LED_SHOW_MAGIC, 4)
+      || data[4] < 1 || data[4] > LED_SHOW_VERSION
+      || data[5] != ROWS || data[6] != COLS) {
+    fail("bad .LEB header");
+  }
+  size_t pos = LED_SHOW_HEADER_SIZE;
+  while (pos < data.size()) {
+    if (data[pos] == LED_SHOW_PAD) {
+      pos++;
+      continue;
+    }
+    if (data[pos] != LED_SHOW_LOOP) {
+      pos += read_show_record(data, pos, data.size());
+      continue;
+    }
+    if (!LedShowRecordSize(&data[pos], data.size() - pos < 3
+                           ? data.size() - pos : 3)
+        || pos + 3 + data[pos + 2] > data.size()) {
+      fail("bad loop in .LEB file");
+    }
+    size_t end = pos + 3 + data[pos + 2];
+    for (uint8_t play = 0; play < data[pos + 1]; play++) {
+      for (size_t at = pos + 3; at < end; ) {
+        at += read_show_record(data, at, end);
+      }
+    }
+    pos = end;
+  }
+  if (lines.empty()) fail("no records in .LEB file");
+}
+
+/* True if the file at path starts with the .LEB magic. */
+static int is_show_file(const char *path) {
+  char magic[4];
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  int ok = fread(magic, 1, 4, f) == 4 && !memcmp(magic, LED_SHOW_MAGIC, 4);
+  fclose(f);
+  return ok;
+}
+
+/* Pass a frame to the matrix, the way the plunger driver does. */
+static void show(const LedFrame &frame) {
+  uint64_t now = sim_cycles;
+  for (int led = 0; led < NUM_LEDS; led++) {
+    struct led_stats *s = &leds[led];
+    if (s->level) s->shown_cycles += now - levels_since;
+    s->level = 0;
+    for (int plane = 0; plane < LED_NUM_PLANES; plane++) {
+      if (frame.planes[plane].bits[led >> 3] & (1 << (led & 7))) {
+        s->level |= 1 << plane;
+      }
+    }
+    if (!s->level) s->off_frames++;
+  }
+  if (frame_list) {
+    static std::string listed;
+    std::string levels;
+    for (int led = 0; led < NUM_LEDS; led++) {
+      levels += "0123456789abcdef"[leds[led].level];
+    }
+    if (levels != listed) {
+      fprintf(frame_list, "%llu %s\n",
+              (unsigned long long)SIM_US(now - run_start) / 1000,
+              levels.c_str());
+      listed = levels;
+    }
+  }
+  levels_since = now;
+  matrix->DisplayFrame(frame);
+  frames_passed++;
+}
+
+/***********************************************************
+ *  Main
+ ***********************************************************/
+
+/* The main loop blocked on the card, polling the busy hook if it has one */
+static void stall(void) {
+  uint64_t start = sim_cycles;
+  uint64_t end = start + stall_length;
+  if (stall_masked) cli();
+  while (sim_cycles < end) {
+    uint64_t step = busy_period ? busy_period : end - sim_cycles;
+    if (step > end - sim_cycles) step = end - sim_cycles;
+    sim_advance(step);
+    if (busy_period) matrix->RunStateMachineFromInterrupt();
+  }
+  if (stall_masked) sei();
+  span_add(&stall_stats, sim_cycles - start);
+}
+
+static void grid_print(const char *name, double (*value)(int led),
+                       const char *format) {
+  printf("%s\n", name);
+  for (int row = 0; row < ROWS; row++) {
+    printf("  ");
+    for (int col = 0; col < COLS; col++) {
+      int led = row * COLS + col;
+      if (leds[led].ever_lit) {
+        printf(format, value(led));
+      } else {
+        printf("%8s", "-");
+      }
+    }
+    printf("\n");
+  }
+}
+
+static uint64_t run_cycles;
+
+static double duty_percent(int led) {
+  return 100.0 * leds[led].on_cycles / run_cycles;
+}
+
+static double refresh_hz(int led) {
+  uint64_t shown = leds[led].shown_cycles;
+  return shown ? (double)leds[led].visits * F_CPU / shown : 0;
+}
+
+static double gap_ms(int led) {
+  return SIM_US((double)leds[led].max_gap) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  unsigned brightness = 255;
+  uint8_t slow_pins = 0;
+  uint8_t loop_refresh = 0;
+  uint8_t skip = LED_SKIP_EVEN;
+  double max_gap_limit = 0;
+  double min_refresh_limit = 0;
+  unsigned long run_ms = 1000;
+  int opt;
+
+  sim_serial_quiet = 1;
+  while ((opt = getopt(argc, argv, "B:b:dF:G:g:ik:lp:R:S:s:T:t:")) != -1) {
+    switch (opt) {
+    case 'B':
+      brightness = atoi(optarg);
+      if (brightness > 255) usage();
+      break;
+    case 'b':
+      busy_period = SIM_CYCLES(atol(optarg));
+      break;
+    case 'd':
+      slow_pins = 1;
+      break;
+    case 'G':
+      max_gap_limit = atof(optarg);
+      break;
+    case 'g':
+      merge_gap = SIM_CYCLES(atol(optarg));
+      break;
+    case 'i':
+      stall_masked = 1;
+      break;
+    case 'k':
+      if (!strcmp(optarg, "off")) {
+        skip = LED_SKIP_OFF;
+      } else if (!strcmp(optarg, "even")) {
+        skip = LED_SKIP_EVEN;
+      } else if (!strcmp(optarg, "fast")) {
+        skip = LED_SKIP_FAST;
+      } else {
+        usage();
+      }
+      break;
+    case 'l':
+      loop_refresh = 1;
+      break;
+    case 'p':
+      loop_period = SIM_CYCLES(atol(optarg));
+      if (!loop_period) usage();
+      break;
+    case 'R':
+      min_refresh_limit = atof(optarg);
+      break;
+    case 'S':
+      stall_period = SIM_CYCLES(atol(optarg) * 1000UL);
+      break;
+    case 's':
+      stall_length = SIM_CYCLES(atol(optarg));
+      break;
+    case 'F':
+      frame_list = fopen(optarg, "w");
+      if (!frame_list) fail("can't open frame list");
+      break;
+    case 'T':
+      trace = fopen(optarg, "w");
+      if (!trace) fail("can't open trace file");
+      fprintf(trace, "time_us,outputs,enable,duty\n");
+      break;
+    case 't':
+      run_ms = atol(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 1) usage();
+  const char *source = argv[optind];
+  uint8_t static_frame = is_pattern(source);
+  if (static_frame) {
+    LedShowEntry line;
+    line.duration = 0;
+    LedMatrix::PackFrame(source, &line.frame);
+    line.is_effect = false;
+    lines.push_back(line);
+  } else if (is_show_file(source)) {
+    read_show_file(source);
+  } else {
+    read_led_file(source);
+  }
+
+  data_pin = slow_pins ? SLOW_DATA_PIN : LED_DATA_PIN;
+  clock_pin = slow_pins ? SLOW_CLOCK_PIN : LED_CLOCK_PIN;
+  oe_pin = slow_pins ? SLOW_OE_PIN : LED_OE_PIN;
+  sim_pin_hook = pin_changed;
+  PORTD.on_write = portd_write;
+  PORTB.on_write = portb_write;
+  TCCR0A.on_write = timer0_write;
+  OCR0A.on_write = timer0_write;
+  TCCR2B.on_write = tccr2b_write;
+  TCNT2.on_read = tcnt2_read;
+  TCNT2.on_write = tcnt2_write;
+  OCR2A.on_write = ocr2a_write;
+  TIFR2.on_read = tifr2_read;
+  TIFR2.on_write = tifr2_write;
+  sim_dispatch = dispatch;
+
+  // What init() does for millis() and the PWM pins
+  TCCR0A = _BV(WGM01) | _BV(WGM00);
+  TCCR0B = _BV(CS01) | _BV(CS00);
+  sei();
+
+  matrix = new LedMatrix(data_pin, clock_pin, oe_pin);
+  matrix->SetRowSkip(skip);
+  matrix->SetBrightness(brightness);
+  if (!loop_refresh) matrix->StartRefreshTimer();
+
+  uint64_t start = sim_cycles;
+  uint64_t end = start + SIM_CYCLES(run_ms * 1000UL);
+  uint64_t next_stall = stall_period ? start + stall_period : 0;
+  uint64_t next_line = start;
+  size_t line = 0;
+  LedFrame last_frame;
+  memset(&last_frame, 0, sizeof(last_frame));
+  const LedShowEntry *effect = 0;
+  uint64_t effect_start = 0;
+  unsigned effect_step = 0;
+  // For a transition, the frame on the line after it and the step count
+  LedFrame next_frame;
+  unsigned effect_steps = 0;
+  levels_since = start;
+  run_start = start;
+  out_since = start;
+
+  while (sim_cycles < end) {
+    if (sim_cycles >= next_line && (!static_frame || line == 0)) {
+      const LedShowEntry *next = &lines[line % lines.size()];
+      if (next->is_effect) {
+        effect = next;
+        effect_start = next_line;
+        effect_step = ~0U;
+        effect_steps = next->duration / next->effect.StepMs();
+        const LedShowEntry *after = &lines[(line + 1) % lines.size()];
+        next_frame = after->is_effect ? last_frame : after->frame;
+      } else {
+        effect = 0;
+        last_frame = next->frame;
+        show(last_frame);
+      }
+      next_line += SIM_CYCLES(next->duration * 1000UL);
+      line++;
+    }
+    if (effect) {
+      unsigned step = SIM_US(sim_cycles - effect_start) / 1000
+          / effect->effect.StepMs();
+      if (step != effect_step) {
+        LedFrame frame;
+        if (effect->effect.Type() == LED_EFFECT_TRANSITION) {
+          effect->effect.Transition(step, effect_steps, last_frame,
+                                    next_frame, &frame);
+        } else {
+          effect->effect.Render(step, last_frame, &frame);
+        }
+        show(frame);
+        effect_step = step;
+      }
+    }
+    matrix->RunStateMachine();
+    sim_advance(loop_period);
+    if (next_stall && sim_cycles >= next_stall) {
+      stall();
+      next_stall += stall_period;
+    }
+  }
+
+  // Close out the last stretch of every LED
+  account();
+  run_cycles = sim_cycles - start;
+  for (int led = 0; led < NUM_LEDS; led++) {
+    struct led_stats *s = &leds[led];
+    if (s->level) s->shown_cycles += sim_cycles - levels_since;
+    if (!s->lit) dark_gap_end(led, sim_cycles);
+  }
+
+  printf("%-18s %s, %s, skip %s, brightness %u\n", "refresh",
+         loop_refresh ? "RunStateMachine()" : "timer 2",
+         slow_pins ? "digitalWrite()" : "port writes",
+         skip == LED_SKIP_OFF ? "off" : skip == LED_SKIP_EVEN ? "even" : "fast",
+         brightness);
+  printf("%-18s %llu ms, %lu frames passed in, %u presented\n", "run",
+         (unsigned long long)SIM_US(run_cycles) / 1000,
+         (unsigned long)frames_passed, matrix->FramesPresented());
+  printf("%-18s %lu\n", "latches", (unsigned long)latches);
+  if (!loop_refresh) {
+    span_print("TIMER2 COMPA", &isr_stats);
+    span_print("interrupt latency", &isr_latency);
+    span_print("polled ticks", &poll_latency);
+  }
+  span_print("stalls", &stall_stats);
+
+  grid_print("duty cycle (%)", duty_percent, "%8.3f");
+  grid_print("refresh (Hz)", refresh_hz, "%8.1f");
+  grid_print("worst dark gap (ms)", gap_ms, "%8.2f");
+
+  // Summary over the LEDs that are lit at some point
+  double min_refresh = 0;
+  int min_refresh_led = -1;
+  int worst_gap_led = -1;
+  double ratio_min = 0, ratio_max = 0;
+  int ratio_count = 0;
+  for (int led = 0; led < NUM_LEDS; led++) {
+    struct led_stats *s = &leds[led];
+    if (!s->shown_cycles) continue;
+    double hz = refresh_hz(led);
+    if (min_refresh_led < 0 || hz < min_refresh) {
+      min_refresh = hz;
+      min_refresh_led = led;
+    }
+    if (worst_gap_led < 0 || s->max_gap > leds[worst_gap_led].max_gap) {
+      worst_gap_led = led;
+    }
+    if (static_frame) {
+      // The share of time the frame asks for: the level out of 15 of one
+      // row's time, at the PWM duty
+      double nominal = s->level / 15.0 / ROWS;
+      if (brightness < 255) {
+        unsigned duty = (brightness * brightness + 254) / 255;
+        nominal *= duty ? (duty + 1) / 256.0 : 0;
+      }
+      double ratio = nominal ? duty_percent(led) / 100.0 / nominal : 0;
+      if (ratio_count++ == 0 || ratio < ratio_min) ratio_min = ratio;
+      if (ratio > ratio_max) ratio_max = ratio;
+    }
+  }
+  if (min_refresh_led < 0) {
+    printf("no LEDs lit\n");
+    return 0;
+  }
+  if (static_frame) {
+    printf("%-18s %.3f to %.3f\n", "duty / nominal", ratio_min, ratio_max);
+  }
+  printf("%-18s %.1f Hz at row %d col %d\n", "slowest refresh",
+         min_refresh, min_refresh_led / COLS, min_refresh_led % COLS);
+  struct led_stats *worst = &leds[worst_gap_led];
+  printf("%-18s %llu us at row %d col %d, from %llu us\n", "worst dark gap",
+         (unsigned long long)SIM_US(worst->max_gap), worst_gap_led / COLS,
+         worst_gap_led % COLS,
+         (unsigned long long)SIM_US(worst->max_gap_at - start));
+  if (trace) fclose(trace);
+
+  int status = 0;
+  if (max_gap_limit && SIM_US(worst->max_gap) > max_gap_limit) {
+    fprintf(stderr, "ledsim: worst dark gap over %.0f us\n", max_gap_limit);
+    status = 1;
+  }
+  if (min_refresh_limit && min_refresh < min_refresh_limit) {
+    fprintf(stderr, "ledsim: refresh under %.1f Hz\n", min_refresh_limit);
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,187 @@
+/*
+ * mkbank.cpp
+ *
+ * Pack .wav files into a sound bank for the WaveHC SoundBank class.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * The PCM data of each file is copied into the bank unchanged, so a clip
+ * plays exactly as the file would.  Files are checked against the same
+ * limits WaveHC::create() applies.  A directory argument adds every .wav
+ * file in it in name order.  The clip numbers are printed as the bank is
+ * built.  The layout is described in libraries/WaveHC/SoundBank.h.
+ *
+ * USAGE:
+ *
+ *   mkbank bank.snd file.wav|directory...
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Must match libraries/WaveHC/SoundBank.h
+#define SOUND_BANK_MAGIC "SBNK"
+#define SOUND_BANK_VERSION 1
+#define SOUND_BANK_ALIGN 512
+#define HEADER_SIZE 8
+#define ENTRY_SIZE 16
+
+struct clip {
+  std::string path;
+  std::vector<unsigned char> data;
+  unsigned long sample_rate;
+  unsigned channels;
+  unsigned bits;
+  unsigned long offset;
+};
+
+static void fail(const char *msg, const char *arg) {
+  fprintf(stderr, "mkbank: %s%s\n", msg, arg ? arg : "");
+  exit(1);
+}
+
+static unsigned long get16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char *p) {
+  return get16(p) | (get16(p + 2) << 16);
+}
+
+static void put16(std::vector<unsigned char> &out, unsigned long offset,
+                  unsigned long v) {
+  out[offset] = v & 0XFF;
+  out[offset + 1] = (v >> 8) & 0XFF;
+}
+
+static void put32(std::vector<unsigned char> &out, unsigned long offset,
+                  unsigned long v) {
+  put16(out, offset, v & 0XFFFF);
+  put16(out, offset + 2, (v >> 16) & 0XFFFF);
+}
+
+/* Read a .wav file and keep its format and PCM data */
+static void read_wav(const char *path, struct clip *c) {
+  FILE *f = fopen(path, "rb");
+  if (!f) fail("can't open ", path);
+  std::vector<unsigned char> file;
+  unsigned char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    file.insert(file.end(), buf, buf + n);
+  }
+  fclose(f);
+
+  if (file.size() < 12 || memcmp(&file[0], "RIFF", 4)
+      || memcmp(&file[8], "WAVE", 4)) {
+    fail("not a RIFF WAVE file: ", path);
+  }
+  int have_fmt = 0;
+  unsigned long pos = 12;
+  while (pos + 8 <= file.size()) {
+    unsigned long size = get32(&file[pos + 4]);
+    const unsigned char *body = &file[pos + 8];
+    if (pos + 8 + size > file.size()) fail("truncated chunk in ", path);
+    if (!memcmp(&file[pos], "fmt ", 4)) {
+      if (size < 16 || get16(body) != 1) fail("not PCM: ", path);
+      c->channels = get16(body + 2);
+      c->sample_rate = get32(body + 4);
+      c->bits = get16(body + 14);
+      have_fmt = 1;
+    } else if (!memcmp(&file[pos], "data", 4)) {
+      if (!have_fmt) fail("data before fmt in ", path);
+      c->data.assign(body, body + size);
+      break;
+    }
+    pos += 8 + size + (size & 1);
+  }
+  if (c->data.empty()) fail("no data chunk in ", path);
+
+  // The limits in WaveHC::create()
+  if (c->channels < 1 || c->channels > 2) fail("not mono or stereo: ", path);
+  if (c->bits != 8 && c->bits != 16) fail("not 8 or 16 bit: ", path);
+  if (c->sample_rate > 22050 ? (c->bits > 8 || c->channels > 1)
+      : c->sample_rate > 16000 && c->bits > 8 && c->channels > 1) {
+    fail("sample rate too high for the format: ", path);
+  }
+  c->path = path;
+}
+
+static int is_wav(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && !strcasecmp(name + len - 4, ".wav");
+}
+
+/* Add a file, or every .wav file in a directory */
+static void add_path(const char *path, std::vector<clip> &clips) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    clips.push_back(clip());
+    read_wav(path, &clips.back());
+    return;
+  }
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != 0) {
+    if (is_wav(entry->d_name)) names.push_back(entry->d_name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string file = std::string(path) + "/" + names[i];
+    clips.push_back(clip());
+    read_wav(file.c_str(), &clips.back());
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: mkbank bank.snd file.wav|directory...\n");
+    return 2;
+  }
+  std::vector<clip> clips;
+  for (int i = 2; i < argc; i++) add_path(argv[i], clips);
+  if (clips.empty()) fail("no .wav files", 0);
+  if (clips.size() > 0XFFFF) fail("too many clips", 0);
+
+  // Header and table, then each clip's data on an aligned boundary
+  unsigned long pos = HEADER_SIZE + ENTRY_SIZE * clips.size();
+  for (size_t i = 0; i < clips.size(); i++) {
+    pos = (pos + SOUND_BANK_ALIGN - 1) & ~(unsigned long)(SOUND_BANK_ALIGN - 1);
+    clips[i].offset = pos;
+    pos += clips[i].data.size();
+  }
+  std::vector<unsigned char> bank(pos, 0);
+  memcpy(&bank[0], SOUND_BANK_MAGIC, 4);
+  put16(bank, 4, SOUND_BANK_VERSION);
+  put16(bank, 6, clips.size());
+  for (size_t i = 0; i < clips.size(); i++) {
+    struct clip &c = clips[i];
+    unsigned long entry = HEADER_SIZE + ENTRY_SIZE * i;
+    put32(bank, entry, c.offset);
+    put32(bank, entry + 4, c.data.size());
+    put32(bank, entry + 8, c.sample_rate);
+    bank[entry + 12] = c.channels;
+    bank[entry + 13] = c.bits;
+    memcpy(&bank[c.offset], &c.data[0], c.data.size());
+    printf("%4lu  %-30s %6lu Hz %2u bit %u ch %8lu bytes\n",
+           (unsigned long)i, c.path.c_str(), c.sample_rate, c.bits,
+           c.channels, (unsigned long)c.data.size());
+  }
+
+  FILE *out = fopen(argv[1], "wb");
+  if (!out || fwrite(&bank[0], 1, bank.size(), out) != bank.size()
+      || fclose(out)) {
+    fail("can't write ", argv[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * mkfatimg.cpp
+ *
+ * Build a FAT16 disk image for the host harnesses.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * The image is a "super floppy" (no partition table) with every file in
+ * the root directory under its 8.3 name, which is how the plunger's cards
+ * are laid out.  With -f the clusters of all files are interleaved so
+ * every cluster change in a file is a jump, to exercise the cluster chain
+ * code.
+ *
+ * USAGE:
+ *
+ *   mkfatimg [-f] [-m megabytes] image.img file...
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROOT_ENTRIES 512
+#define MAX_FILES 256
+
+struct input_file {
+  const char *path;
+  char name[11];
+  unsigned char *data;
+  unsigned long size;
+  unsigned long clusters;
+  unsigned long first_cluster;
+};
+
+static unsigned char *image;
+
+static void put16(unsigned long offset, unsigned v) {
+  image[offset] = v & 0XFF;
+  image[offset + 1] = (v >> 8) & 0XFF;
+}
+
+static void put32(unsigned long offset, unsigned long v) {
+  put16(offset, v & 0XFFFF);
+  put16(offset + 2, (v >> 16) & 0XFFFF);
+}
+
+static void fail(const char *msg, const char *arg) {
+  fprintf(stderr, "mkfatimg: %s%s\n", msg, arg ? arg : "");
+  exit(1);
+}
+
+/* Convert a file's base name to a padded, upper case 8.3 directory name */
+static void short_name(const char *path, char name[11]) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  memset(name, ' ', 11);
+  int i = 0;
+  while (*base && *base != '.' && i < 8) name[i++] = toupper(*base++);
+  while (*base && *base != '.') base++;
+  if (*base == '.') base++;
+  for (i = 8; *base && i < 11; i++) name[i] = toupper(*base++);
+}
+
+int main(int argc, char **argv) {
+  int fragment = 0;
+  unsigned long megabytes = 16;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "fm:")) != -1) {
+    switch (opt) {
+    case 'f':
+      fragment = 1;
+      break;
+    case 'm':
+      megabytes = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: mkfatimg [-f] [-m megabytes] image file...\n");
+      return 2;
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "usage: mkfatimg [-f] [-m megabytes] image file...\n");
+    return 2;
+  }
+  int file_count = argc - optind - 1;
+  if (file_count > MAX_FILES) fail("too many files", 0);
+
+  // Pick a cluster size that keeps the volume FAT16
+  unsigned long total = megabytes * 2048;
+  unsigned long per_cluster = 1;
+  unsigned long fat_sectors = 0, clusters = 0;
+  unsigned long root_sectors = ROOT_ENTRIES * 32 / 512;
+  for (;;) {
+    clusters = (total - 1 - root_sectors) / per_cluster;
+    fat_sectors = ((clusters + 2) * 2 + 511) / 512;
+    clusters = (total - 1 - 2 * fat_sectors - root_sectors) / per_cluster;
+    if (clusters < 65525) break;
+    per_cluster *= 2;
+  }
+  if (clusters < 4085) fail("image too small for FAT16", 0);
+  unsigned long fat_start = 1;
+  unsigned long root_start = fat_start + 2 * fat_sectors;
+  unsigned long data_start = root_start + root_sectors;
+  unsigned long cluster_bytes = per_cluster * 512;
+
+  image = (unsigned char *)calloc(total, 512);
+  if (!image) fail("out of memory", 0);
+
+  // Boot sector and BIOS parameter block
+  image[0] = 0XEB;
+  image[1] = 0X3C;
+  image[2] = 0X90;
+  memcpy(&image[3], "PLUNGER ", 8);
+  put16(11, 512);
+  image[13] = per_cluster;
+  put16(14, 1);
+  image[16] = 2;
+  put16(17, ROOT_ENTRIES);
+  put16(19, total < 65536 ? total : 0);
+  image[21] = 0XF8;
+  put16(22, fat_sectors);
+  put16(24, 32);
+  put16(26, 64);
+  put32(28, 0);
+  put32(32, total < 65536 ? 0 : total);
+  image[36] = 0X80;
+  image[38] = 0X29;
+  put32(39, 0X20090826);
+  memcpy(&image[43], "PLUNGER    ", 11);
+  memcpy(&image[54], "FAT16   ", 8);
+  image[510] = 0X55;
+  image[511] = 0XAA;
+
+  // Read the files and work out how many clusters each needs
+  struct input_file files[MAX_FILES];
+  unsigned long needed = 0;
+  for (int i = 0; i < file_count; i++) {
+    struct input_file *f = &files[i];
+    f->path = argv[optind + 1 + i];
+    short_name(f->path, f->name);
+    FILE *in = fopen(f->path, "rb");
+    if (!in) fail("can't open ", f->path);
+    fseek(in, 0, SEEK_END);
+    f->size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    f->data = (unsigned char *)malloc(f->size + 1);
+    if (fread(f->data, 1, f->size, in) != f->size) fail("can't read ", f->path);
+    fclose(in);
+    f->clusters = (f->size + cluster_bytes - 1) / cluster_bytes;
+    f->first_cluster = 0;
+    needed += f->clusters;
+  }
+  if (needed > clusters) fail("files do not fit, use -m", 0);
+
+  // Allocate clusters, either file by file or round robin
+  unsigned long *fat = (unsigned long *)calloc(clusters + 2, sizeof(long));
+  fat[0] = 0XFFF8;
+  fat[1] = 0XFFFF;
+  unsigned long next_free = 2;
+  unsigned long *last = (unsigned long *)calloc(file_count, sizeof(long));
+  unsigned long *done = (unsigned long *)calloc(file_count, sizeof(long));
+  int remaining = 1;
+  while (remaining) {
+    remaining = 0;
+    for (int i = 0; i < file_count; i++) {
+      struct input_file *f = &files[i];
+      unsigned long take = fragment ? 1 : f->clusters;
+      for (unsigned long n = 0; n < take && done[i] < f->clusters; n++) {
+        unsigned long c = next_free++;
+        unsigned long offset = done[i] * cluster_bytes;
+        unsigned long count = f->size - offset < cluster_bytes
+                                  ? f->size - offset : cluster_bytes;
+        memcpy(&image[(data_start + (c - 2) * per_cluster) * 512],
+               &f->data[offset], count);
+        if (done[i] == 0) {
+          f->first_cluster = c;
+        } else {
+          fat[last[i]] = c;
+        }
+        fat[c] = 0XFFFF;
+        last[i] = c;
+        done[i]++;
+      }
+      if (done[i] < f->clusters) remaining = 1;
+    }
+  }
+
+  // Both copies of the FAT
+  for (unsigned long copy = 0; copy < 2; copy++) {
+    unsigned long base = (fat_start + copy * fat_sectors) * 512;
+    for (unsigned long c = 0; c < clusters + 2; c++) {
+      put16(base + 2 * c, fat[c]);
+    }
+  }
+
+  // Root directory
+  for (int i = 0; i < file_count; i++) {
+    unsigned long entry = root_start * 512 + 32 * i;
+    memcpy(&image[entry], files[i].name, 11);
+    image[entry + 11] = 0X20;  // archive
+    put16(entry + 26, files[i].first_cluster);
+    put32(entry + 28, files[i].size);
+  }
+
+  FILE *out = fopen(argv[optind], "wb");
+  if (!out || fwrite(image, 512, total, out) != total || fclose(out)) {
+    fail("can't write ", argv[optind]);
+  }
+  return 0;
+}
@@ -0,0 +1,434 @@
+/*
+ * mkleb.cpp
+ *
+ * Check a .led file, report its timing, and compile it into the binary
+ * .LEB form the plunger driver loads without parsing.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * Every line is checked, and each problem is reported with its line and
+ * column.  Lines are parsed by the library code the driver runs, so an
+ * effect is accepted here only if the plunger would accept it.  Lines
+ * that would show but probably not as meant, such as frames shorter than
+ * one scan of the matrix, are warnings.
+ *
+ * Each line becomes a record, compressed three ways:
+ *
+ *   - runs of identical frames become one frame shown for their total time
+ *   - a frame is stored as whichever is shortest of its bit planes, a
+ *     bitmap and a level if its lit LEDs share one, or the changes from
+ *     the frame before
+ *   - a run of records repeated in a cycle, like the flush animations,
+ *     is stored once in a loop record that the driver replays from RAM
+ *
+ * Records are kept within 512 byte blocks.  The layout is described in
+ * libraries/LedMatrix/LedShow.h.  Without an output file the .led file is
+ * only checked.  A file with errors isn't written.
+ *
+ * USAGE:
+ *
+ *   mkleb [-v] file.led [FILE.LEB]
+ *
+ *   -v  list the records as they are written
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "LedMatrix.h"
+#include "LedEffect.h"
+#include "LedShow.h"
+
+#define NUM_LEDS (LED_NUM_ROWS * LED_NUM_COLS)
+#define MAX_DURATION ((1UL << (7 * LED_SHOW_MAX_VARINT)) - 1)
+// Loops are looked for up to this many records long
+#define MAX_LOOP_RECORDS 16
+// One scan of the matrix, see LedMatrix.cpp
+#define SCAN_MS 10
+
+struct record {
+  bool is_effect;
+  unsigned long duration;
+  std::string text;               // the 7 characters of an effect
+  unsigned char levels[NUM_LEDS];  // 0-15 for a frame
+  unsigned long line;             // first line it came from
+
+  bool operator==(const record &r) const {
+    return is_effect == r.is_effect && duration == r.duration
+        && (is_effect ? text == r.text
+            : !memcmp(levels, r.levels, sizeof(levels)));
+  }
+};
+
+struct stats {
+  unsigned long lines;
+  unsigned long frames;
+  unsigned long effects;
+  unsigned long total_ms;
+  unsigned long min_ms;
+  unsigned long max_ms;
+  unsigned long short_frames;
+  unsigned long errors;
+  unsigned long warnings;
+};
+
+static const char *path;
+static struct stats st;
+static bool verbose;
+
+static void fail(const char *msg, const char *arg) {
+  fprintf(stderr, "mkleb: %s%s\n", msg, arg ? arg : "");
+  exit(1);
+}
+
+static void report(const char *kind, unsigned long line, int col,
+                   const char *msg) {
+  if (col > 0) {
+    fprintf(stderr, "%s:%lu:%d: %s: %s\n", path, line, col, kind, msg);
+  } else {
+    fprintf(stderr, "%s:%lu: %s: %s\n", path, line, kind, msg);
+  }
+}
+
+static void error(unsigned long line, int col, const char *msg) {
+  report("error", line, col, msg);
+  st.errors++;
+}
+
+static void warning(unsigned long line, const char *msg) {
+  report("warning", line, 0, msg);
+  st.warnings++;
+}
+
+/* Check a line and turn it into a record.  Returns false on an error. */
+static bool parse_line(const char *buf, size_t len, unsigned long line,
+                       record *r) {
+  if (len != 4 + NUM_LEDS) {
+    char msg[80];
+    snprintf(msg, sizeof(msg), "%lu characters, not %d",
+             (unsigned long)len, 4 + NUM_LEDS);
+    error(line, 0, msg);
+    return false;
+  }
+  for (int i = 0; i < 4; i++) {
+    if (buf[i] < '0' || buf[i] > '9') {
+      error(line, i + 1, "duration isn't 4 digits");
+      return false;
+    }
+  }
+  r->duration = atoi(std::string(buf, 4).c_str());
+  r->line = line;
+  const char *values = buf + 4;
+  LedEffect effect;
+  if (values[0] < '0' || values[0] > '9') {
+    if (!effect.Parse(values)) {
+      error(line, 5, "not an effect");
+      return false;
+    }
+    r->is_effect = true;
+    r->text.assign(values, LED_SHOW_EFFECT_SIZE);
+    if (effect.StepMs() > r->duration) {
+      warning(line, "effect step is longer than the line");
+    }
+    return true;
+  }
+  for (int led = 0; led < NUM_LEDS; led++) {
+    if (values[led] < '0' || values[led] > '9') {
+      error(line, led + 5, "LED value isn't a digit");
+      return false;
+    }
+    r->levels[led] = LedMatrixBase::Level(values[led]);
+  }
+  r->is_effect = false;
+  return true;
+}
+
+/* Read and check a .led file, merging runs of identical frames */
+static void read_led(std::vector<record> &records) {
+  FILE *f = fopen(path, "r");
+  if (!f) fail("can't open ", path);
+  char buf[256];
+  unsigned long line = 0;
+  st.min_ms = ~0UL;
+  while (fgets(buf, sizeof(buf), f)) {
+    line++;
+    size_t len = strcspn(buf, "\r\n");
+    if (len == 0) continue;
+    buf[len] = 0;
+    record r;
+    if (!parse_line(buf, len, line, &r)) continue;
+
+    st.lines++;
+    st.total_ms += r.duration;
+    if (r.duration < st.min_ms) st.min_ms = r.duration;
+    if (r.duration > st.max_ms) st.max_ms = r.duration;
+    if (r.is_effect) {
+      st.effects++;
+    } else {
+      st.frames++;
+      if (r.duration < SCAN_MS) {
+        st.short_frames++;
+        warning(line, r.duration ? "frame is shorter than one scan"
+                : "frame has no duration");
+      }
+    }
+    if (!r.is_effect && !records.empty()) {
+      record &last = records.back();
+      if (!last.is_effect
+          && !memcmp(last.levels, r.levels, sizeof(r.levels))
+          && last.duration + r.duration <= MAX_DURATION) {
+        last.duration += r.duration;
+        continue;
+      }
+    }
+    records.push_back(r);
+  }
+  fclose(f);
+  if (!st.lines && !st.errors) fail("no lines in ", path);
+
+  // Transitions need a frame on each side
+  for (size_t i = 0; i < records.size(); i++) {
+    if (!records[i].is_effect
+        || records[i].text[0] != LED_EFFECT_TRANSITION) {
+      continue;
+    }
+    if (i == 0 || records[i - 1].is_effect) {
+      warning(records[i].line, "transition doesn't follow a frame");
+    }
+    if (i + 1 == records.size() || records[i + 1].is_effect) {
+      warning(records[i].line, "transition isn't followed by a frame");
+    }
+  }
+}
+
+static void put_varint(std::string &out, unsigned long v) {
+  while (v >= 0X80) {
+    out += (char)(0X80 | (v & 0X7F));
+    v >>= 7;
+  }
+  out += (char)v;
+}
+
+/*
+ * The shortest record for r.  prev is the frame before it, or null if it
+ * can't be a delta.
+ */
+static std::string encode(const record &r, const record *prev) {
+  std::string out;
+  if (r.is_effect) {
+    out += (char)LED_SHOW_EFFECT;
+    put_varint(out, r.duration);
+    return out + r.text;
+  }
+
+  // Bit planes, as PackFrame() makes them
+  LedFrame frame;
+  memset(&frame, 0, sizeof(frame));
+  unsigned char lit[(NUM_LEDS + 7) / 8];
+  memset(lit, 0, sizeof(lit));
+  int single = -1;
+  for (int led = 0; led < NUM_LEDS; led++) {
+    unsigned char level = r.levels[led];
+    for (int plane = 0; plane < LED_NUM_PLANES; plane++) {
+      if (level & (1 << plane)) {
+        frame.planes[plane].bits[led >> 3] |= 1 << (led & 7);
+      }
+    }
+    if (!level) continue;
+    lit[led >> 3] |= 1 << (led & 7);
+    single = single < 0 || single == level ? level : 0;
+  }
+  if (single != 0) {
+    // All dark, or every lit LED at the same level
+    out += (char)LED_SHOW_BITMAP;
+    put_varint(out, r.duration);
+    out += (char)(single < 0 ? 0 : single);
+    out.append((const char *)lit, sizeof(lit));
+  } else {
+    out += (char)LED_SHOW_FRAME;
+    put_varint(out, r.duration);
+    out.append((const char *)&frame, sizeof(frame));
+  }
+
+  if (prev) {
+    std::string leds, levels;
+    for (int led = 0; led < NUM_LEDS; led++) {
+      if (r.levels[led] == prev->levels[led]) continue;
+      if (leds.size() & 1) {
+        levels[levels.size() - 1] |= r.levels[led] << 4;
+      } else {
+        levels += (char)r.levels[led];
+      }
+      leds += (char)led;
+    }
+    if (leds.size() <= LED_SHOW_MAX_DELTA) {
+      std::string delta(1, (char)LED_SHOW_DELTA);
+      delta += (char)leds.size();
+      put_varint(delta, r.duration);
+      delta += leds + levels;
+      if (!leds.empty() && delta.size() < out.size()) out = delta;
+    }
+  }
+  return out;
+}
+
+/* Records from first to last encoded in a row, the first not a delta */
+static std::string encode_run(const std::vector<record> &records,
+                              size_t first, size_t last) {
+  std::string out;
+  for (size_t i = first; i < last; i++) {
+    const record *prev = i > first && !records[i - 1].is_effect
+        ? &records[i - 1] : 0;
+    out += encode(records[i], prev);
+  }
+  return out;
+}
+
+/*
+ * The loop at records[i] that saves the most bytes: its length in
+ * records, plays and encoding.  Returns false if none saves anything.
+ */
+static bool find_loop(const std::vector<record> &records, size_t i,
+                      size_t *length, unsigned *plays, std::string *body) {
+  long best = 0;
+  for (size_t p = 1; p <= MAX_LOOP_RECORDS && i + 2 * p <= records.size();
+       p++) {
+    unsigned n = 1;
+    while (n < 255 && i + (n + 1) * p <= records.size()) {
+      bool same = true;
+      for (size_t k = 0; k < p && same; k++) {
+        same = records[i + n * p + k] == records[i + k];
+      }
+      if (!same) break;
+      n++;
+    }
+    if (n < 2) continue;
+    std::string run = encode_run(records, i, i + p);
+    if (run.size() > LED_SHOW_LOOP_SIZE) continue;
+    // Against the same records written out, the first not a delta
+    std::string plain = encode_run(records, i, i + n * p);
+    long saved = (long)plain.size() - (long)(3 + run.size());
+    if (saved > best) {
+      best = saved;
+      *length = p;
+      *plays = n;
+      *body = run;
+    }
+  }
+  return best > 0;
+}
+
+/* Append bytes that must stay in one block */
+static void append(std::string &out, const std::string &bytes,
+                   unsigned long *pad) {
+  size_t left = LED_SHOW_SECTOR - out.size() % LED_SHOW_SECTOR;
+  if (bytes.size() > left) {
+    out.append(left, (char)LED_SHOW_PAD);
+    *pad += left;
+  }
+  out += bytes;
+}
+
+static const char *kind_name(int kind) {
+  static const char *names[] = {
+    "pad", "frame", "bitmap", "effect", "delta", "loop"
+  };
+  return kind >= 0 && kind <= LED_SHOW_LOOP ? names[kind] : "?";
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    if (opt == 'v') {
+      verbose = true;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2) {
+    fprintf(stderr, "usage: mkleb [-v] file.led [FILE.LEB]\n");
+    return 2;
+  }
+  path = argv[optind];
+  const char *out_path = argc - optind > 1 ? argv[optind + 1] : 0;
+
+  std::vector<record> records;
+  read_led(records);
+
+  double seconds = st.total_ms / 1000.0;
+  unsigned long text_bytes = st.lines * (4 + NUM_LEDS + 1);
+  printf("%lu lines: %lu frames, %lu effects, %lu errors, %lu warnings\n",
+         st.lines, st.frames, st.effects, st.errors, st.warnings);
+  if (st.lines) {
+    printf("%.3f s shown, lines %lu to %lu ms, %.1f ms mean, %lu frames "
+           "shorter than a %d ms scan\n", seconds, st.min_ms, st.max_ms,
+           (double)st.total_ms / st.lines, st.short_frames, SCAN_MS);
+    printf(".led  %7lu bytes, %7.0f bytes/s\n", text_bytes,
+           seconds > 0 ? text_bytes / seconds : 0.0);
+  }
+  if (st.errors) return 1;
+  if (!out_path) return 0;
+
+  std::string out(LED_SHOW_MAGIC, 4);
+  out += (char)LED_SHOW_VERSION;
+  out += (char)LED_NUM_ROWS;
+  out += (char)LED_NUM_COLS;
+  out += (char)0;
+  unsigned long counts[LED_SHOW_LOOP + 1] = {0};
+  unsigned long pad = 0;
+  for (size_t i = 0; i < records.size();) {
+    size_t length = 0;
+    unsigned plays = 0;
+    std::string body;
+    if (find_loop(records, i, &length, &plays, &body)) {
+      std::string loop(1, (char)LED_SHOW_LOOP);
+      loop += (char)plays;
+      loop += (char)body.size();
+      append(out, loop + body, &pad);
+      counts[LED_SHOW_LOOP]++;
+      if (verbose) {
+        printf("%6lu loop of %lu records, %u plays, %lu bytes\n",
+               (unsigned long)(out.size() - body.size() - 3),
+               (unsigned long)length, plays, (unsigned long)body.size());
+      }
+      for (size_t k = 0; k < length; k++) {
+        counts[(unsigned char)body[0]]++;
+        body.erase(0, LedShowRecordSize((const unsigned char *)body.data(),
+                                        body.size()));
+      }
+      i += length * plays;
+      continue;
+    }
+    const record *prev = i > 0 && !records[i - 1].is_effect
+        ? &records[i - 1] : 0;
+    std::string bytes = encode(records[i], prev);
+    append(out, bytes, &pad);
+    counts[(unsigned char)bytes[0]]++;
+    if (verbose) {
+      printf("%6lu %-6s %7lu ms %2lu bytes, line %lu\n",
+             (unsigned long)(out.size() - bytes.size()),
+             kind_name(bytes[0]), records[i].duration,
+             (unsigned long)bytes.size(), records[i].line);
+    }
+    i++;
+  }
+
+  FILE *f = fopen(out_path, "wb");
+  if (!f || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f)) {
+    fail("can't write ", out_path);
+  }
+  printf(".LEB  %7lu bytes, %7.0f bytes/s, %lu of padding\n",
+         (unsigned long)out.size(), seconds > 0 ? out.size() / seconds : 0.0,
+         pad);
+  printf("records: %lu frames, %lu bitmaps, %lu deltas, %lu effects, "
+         "%lu loops\n", counts[LED_SHOW_FRAME], counts[LED_SHOW_BITMAP],
+         counts[LED_SHOW_DELTA], counts[LED_SHOW_EFFECT],
+         counts[LED_SHOW_LOOP]);
+  return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * mkshow.cpp
+ *
+ * Put a compiled LED show into a .wav file, so that the plunger driver
+ * plays the two from one file in step.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * The show's records are split into "leds" chunks of at most
+ * LED_SHOW_CHUNK_SIZE bytes, each written just ahead of the audio in which
+ * the record before its first one starts, so the driver has a record in
+ * RAM before the one ahead of it is shown and a transition can see the
+ * frame it goes to.  The audio is cut into data chunks between them on
+ * 256 byte boundaries, and "JUNK" chunks line each one up on one, so
+ * WaveHC's refills are the same whole reads as for a plain file.  The
+ * layout is described in libraries/LedMatrix/LedShow.h.
+ *
+ * The driver takes the chunks into a ring of twice LED_SHOW_CHUNK_SIZE
+ * bytes as the audio is read, up to two buffers ahead of what is heard,
+ * and frees each record's bytes when it is shown.  The ring is checked
+ * against that, and a show too dense for it isn't written.  Records that
+ * start after the audio ends are dropped.
+ *
+ * Compile a .led file with mkleb first.
+ *
+ * USAGE:
+ *
+ *   mkshow [-v] file.wav FILE.LEB SHOW.WAV
+ *
+ *   -v  list the chunks as they are written
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "LedMatrix.h"
+#include "LedShow.h"
+
+// Must match PLAYBUFFLEN in libraries/WaveHC/WaveHC.cpp
+#define PLAY_BUFFER 256
+// The driver's ring of LED data, LED_STREAM_SIZE in plunger_driver.pde
+#define RING_SIZE (2 * LED_SHOW_CHUNK_SIZE)
+
+/* A record, or a loop with its records, and when it is shown */
+struct unit {
+  std::string bytes;
+  unsigned long start_ms;
+  unsigned long end_ms;
+  // The driver has decoded it, and freed its bytes, by this time
+  unsigned long free_ms;
+};
+
+/* A leds chunk and the audio after it */
+struct chunk {
+  size_t first;  // its units
+  size_t count;
+  unsigned long bytes;
+  unsigned long audio_start;  // byte offset in the PCM data
+  unsigned long audio_len;
+};
+
+struct wav {
+  std::vector<unsigned char> fmt;  // the fmt chunk's data
+  std::vector<unsigned char> data;
+  unsigned long sample_rate;
+  unsigned channels;
+  unsigned bits;
+};
+
+static bool verbose;
+
+static void fail(const char *msg, const char *arg) {
+  fprintf(stderr, "mkshow: %s%s\n", msg, arg ? arg : "");
+  exit(1);
+}
+
+static unsigned long get16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char *p) {
+  return get16(p) | (get16(p + 2) << 16);
+}
+
+static void put32(std::string &out, unsigned long v) {
+  for (int i = 0; i < 4; i++) {
+    out += (char)((v >> (8 * i)) & 0XFF);
+  }
+}
+
+static void put_chunk(std::string &out, const char *id,
+                      const unsigned char *data, unsigned long len) {
+  out.append(id, 4);
+  put32(out, len);
+  out.append((const char *)data, len);
+  if (len & 1) {
+    out += (char)0;
+  }
+}
+
+static void read_file(const char *path, std::vector<unsigned char> &file) {
+  FILE *f = fopen(path, "rb");
+  if (!f) fail("can't open ", path);
+  unsigned char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    file.insert(file.end(), buf, buf + n);
+  }
+  fclose(f);
+}
+
+/* Read a .wav file and keep its fmt chunk and PCM data */
+static void read_wav(const char *path, struct wav *w) {
+  std::vector<unsigned char> file;
+  read_file(path, file);
+  if (file.size() < 12 || memcmp(&file[0], "RIFF", 4)
+      || memcmp(&file[8], "WAVE", 4)) {
+    fail("not a RIFF WAVE file: ", path);
+  }
+  unsigned long pos = 12;
+  while (pos + 8 <= file.size()) {
+    unsigned long size = get32(&file[pos + 4]);
+    const unsigned char *body = &file[pos + 8];
+    if (pos + 8 + size > file.size()) fail("truncated chunk in ", path);
+    if (!memcmp(&file[pos], "fmt ", 4)) {
+      if ((size != 16 && size != 18) || get16(body) != 1
+          || (size == 18 && get16(body + 16))) {
+        fail("not PCM: ", path);
+      }
+      w->fmt.assign(body, body + size);
+      w->channels = get16(body + 2);
+      w->sample_rate = get32(body + 4);
+      w->bits = get16(body + 14);
+    } else if (!memcmp(&file[pos], "data", 4)) {
+      if (w->fmt.empty()) fail("data before fmt in ", path);
+      w->data.assign(body, body + size);
+      break;
+    } else if (!memcmp(&file[pos], LED_SHOW_CHUNK_ID, 4)) {
+      fail("already has a show: ", path);
+    }
+    pos += 8 + size + (size & 1);
+  }
+  if (w->data.empty()) fail("no data chunk in ", path);
+
+  // The limits in WaveHC::create()
+  if (w->channels < 1 || w->channels > 2) fail("not mono or stereo: ", path);
+  if (w->bits != 8 && w->bits != 16) fail("not 8 or 16 bit: ", path);
+  if (w->sample_rate > 22050 ? (w->bits > 8 || w->channels > 1)
+      : w->sample_rate > 16000 && w->bits > 8 && w->channels > 1) {
+    fail("sample rate too high for the format: ", path);
+  }
+}
+
+/* The duration of the record at p, which LedShowRecordSize() passed */
+static unsigned long duration(const unsigned char *p) {
+  unsigned long ms = 0;
+  int i = p[0] == LED_SHOW_DELTA ? 2 : 1;
+  for (int shift = 0; ; shift += 7) {
+    ms |= (unsigned long)(p[i] & 0X7F) << shift;
+    if (!(p[i++] & 0X80)) {
+      return ms;
+    }
+  }
+}
+
+/* The size of the record at p, with n bytes of the file left, or fail */
+static unsigned record_size(const unsigned char *p, unsigned long n,
+                            const char *path) {
+  unsigned size = LedShowRecordSize(p, n < LED_SHOW_HEAD_SIZE
+                                    ? n : LED_SHOW_HEAD_SIZE);
+  if (!size || size > n) fail("bad record in ", path);
+  return size;
+}
+
+/* Read a .LEB file into its header and units, without the padding */
+static void read_leb(const char *path, std::string &header,
+                     std::vector<unit> &units) {
+  std::vector<unsigned char> file;
+  read_file(path, file);
+  if (file.size() < LED_SHOW_HEADER_SIZE
+      || memcmp(&file[0], LED_SHOW_MAGIC, 4)
+      || file[4] < 1 || file[4] > LED_SHOW_VERSION
+      || file[5] != LED_NUM_ROWS || file[6] != LED_NUM_COLS) {
+    fail("not a .LEB show for this matrix: ", path);
+  }
+  header.assign((const char *)&file[0], LED_SHOW_HEADER_SIZE);
+
+  unsigned long ms = 0;
+  unsigned long pos = LED_SHOW_HEADER_SIZE;
+  while (pos < file.size()) {
+    const unsigned char *p = &file[pos];
+    if (*p == LED_SHOW_PAD) {
+      pos++;
+      continue;
+    }
+    unsigned size = record_size(p, file.size() - pos, path);
+    unit u;
+    u.start_ms = ms;
+    if (*p == LED_SHOW_LOOP) {
+      unsigned long len = p[2];
+      if (pos + size + len > file.size()) fail("bad loop in ", path);
+      unsigned long cycle = 0;
+      unsigned long last = 0;
+      for (unsigned long i = 0; i < len; i += last) {
+        last = record_size(p + size + i, len - i, path);
+        cycle += duration(p + size + i);
+      }
+      size += len;
+      ms += p[1] * cycle;
+      // Its bytes stay in the ring until the last play
+      u.free_ms = ms;
+    } else {
+      ms += duration(p);
+      u.free_ms = u.start_ms;
+    }
+    u.end_ms = ms;
+    u.bytes.assign((const char *)p, size);
+    units.push_back(u);
+    pos += size;
+  }
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    if (opt == 'v') {
+      verbose = true;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc - optind != 3) {
+    fprintf(stderr, "usage: mkshow [-v] file.wav FILE.LEB SHOW.WAV\n");
+    return 2;
+  }
+  struct wav w;
+  read_wav(argv[optind], &w);
+  std::string header;
+  std::vector<unit> units;
+  read_leb(argv[optind + 1], header, units);
+
+  double bytes_per_ms = w.sample_rate * w.channels * (w.bits / 8) / 1000.0;
+  unsigned long audio_ms = (unsigned long)(w.data.size() / bytes_per_ms);
+  size_t dropped = 0;
+  while (!units.empty() && units.back().start_ms >= audio_ms) {
+    units.pop_back();
+    dropped++;
+  }
+  if (dropped) {
+    fprintf(stderr, "mkshow: warning: %lu records start after the audio "
+            "ends and are dropped\n", (unsigned long)dropped);
+  }
+
+  // Fill each chunk with whole units, and start its audio at a buffer
+  // boundary before the unit ahead of its first
+  std::vector<chunk> chunks;
+  for (size_t i = 0; i < units.size(); i++) {
+    if (chunks.empty() || chunks.back().bytes + units[i].bytes.size()
+                          > LED_SHOW_CHUNK_SIZE) {
+      chunk c;
+      c.first = i;
+      c.count = 0;
+      c.bytes = 0;
+      unsigned long ms = i > 0 ? units[i - 1].start_ms : 0;
+      c.audio_start = (unsigned long)(ms * bytes_per_ms)
+          / PLAY_BUFFER * PLAY_BUFFER;
+      if (c.audio_start > w.data.size()) {
+        c.audio_start = w.data.size();
+      }
+      chunks.push_back(c);
+    }
+    chunks.back().count++;
+    chunks.back().bytes += units[i].bytes.size();
+  }
+  if (chunks.empty()) {
+    fail("no records in ", argv[optind + 1]);
+  }
+  for (size_t k = 0; k < chunks.size(); k++) {
+    unsigned long end = k + 1 < chunks.size()
+        ? chunks[k + 1].audio_start : w.data.size();
+    chunks[k].audio_len = end - chunks[k].audio_start;
+  }
+
+  // What the ring holds when each chunk comes in: a refill can read it
+  // two buffers before the audio after it is heard
+  unsigned long peak = 0;
+  for (size_t k = 0; k < chunks.size(); k++) {
+    unsigned long early = 2 * PLAY_BUFFER;
+    unsigned long arrive_ms = chunks[k].audio_start > early
+        ? (unsigned long)((chunks[k].audio_start - early) / bytes_per_ms)
+        : 0;
+    unsigned long held = 0;
+    for (size_t i = 0; i < chunks[k].first + chunks[k].count; i++) {
+      if (units[i].free_ms >= arrive_ms) {
+        held += units[i].bytes.size();
+      }
+    }
+    if (held > peak) {
+      peak = held;
+    }
+    if (held > RING_SIZE) {
+      fprintf(stderr, "mkshow: the show is too dense at %lu ms: the "
+              "driver would hold %lu bytes of it, more than %d\n",
+              units[chunks[k].first].start_ms, held, RING_SIZE);
+      return 1;
+    }
+  }
+
+  std::string out("RIFF", 4);
+  put32(out, 0);
+  out += "WAVE";
+  put_chunk(out, "fmt ", &w.fmt[0], w.fmt.size());
+  unsigned long record_bytes = 0;
+  for (size_t k = 0; k < chunks.size(); k++) {
+    const chunk &c = chunks[k];
+    std::string leds = k == 0 ? header : std::string();
+    for (size_t i = c.first; i < c.first + c.count; i++) {
+      leds += units[i].bytes;
+    }
+    // WaveHC doesn't skip the pad byte after an odd sized chunk, so pad
+    // the records instead; the driver skips padding
+    if (leds.size() & 1) {
+      leds += (char)LED_SHOW_PAD;
+    }
+    record_bytes += c.bytes;
+    put_chunk(out, LED_SHOW_CHUNK_ID, (const unsigned char *)leds.data(),
+              leds.size());
+    if (c.audio_len) {
+      // Line the audio up on a buffer boundary
+      unsigned long junk = (PLAY_BUFFER - (out.size() + 16) % PLAY_BUFFER)
+          % PLAY_BUFFER;
+      std::vector<unsigned char> zeros(junk, 0);
+      put_chunk(out, "JUNK", junk ? &zeros[0] : 0, junk);
+      put_chunk(out, "data", &w.data[c.audio_start], c.audio_len);
+    }
+    if (verbose) {
+      printf("%8lu ms  %3lu records %3lu bytes, audio %8lu + %6lu\n",
+             units[c.first].start_ms, (unsigned long)c.count, c.bytes,
+             c.audio_start, c.audio_len);
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = (char)(((out.size() - 8) >> (8 * i)) & 0XFF);
+  }
+
+  FILE *f = fopen(argv[optind + 2], "wb");
+  if (!f || fwrite(out.data(), 1, out.size(), f) != out.size()
+      || fclose(f)) {
+    fail("can't write ", argv[optind + 2]);
+  }
+  printf("%.3f s of audio, %.3f s of show in %lu records\n",
+         audio_ms / 1000.0,
+         units.empty() ? 0.0 : units.back().end_ms / 1000.0,
+         (unsigned long)units.size());
+  unsigned long overhead = out.size() - 12 - 8 - w.fmt.size()
+      - w.data.size() - record_bytes;
+  printf("%lu chunks, %lu bytes of records, %lu bytes of headers and "
+         "padding, at most %lu of %d bytes held\n",
+         (unsigned long)chunks.size(), record_bytes, overhead, peak,
+         RING_SIZE);
+  printf("%s: %lu bytes\n", argv[optind + 2], (unsigned long)out.size());
+  return 0;
+}
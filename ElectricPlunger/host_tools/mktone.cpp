@@ -0,0 +1,100 @@
+/*
+ * mktone.cpp
+ *
+ * Write a sine tone as a 16 bit mono .wav file that wavesim renders back
+ * unchanged.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * The DAC is 12 bits, so the low 4 bits of each sample are left clear,
+ * and WaveHC stops at the last full buffer, so the data is a whole number
+ * of 256 byte buffers.  The header is the 44 bytes wavesim writes.  A
+ * render of the file can then be compared with it byte for byte.
+ *
+ * USAGE:
+ *
+ *   mktone [-f hz] [-r rate] [-s sec] TONE.WAV
+ *
+ *   -f hz     frequency of the tone (default 440)
+ *   -r rate   sample rate (default 22050)
+ *   -s sec    length, rounded down to whole buffers (default 2)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// WaveHC's play buffer
+#define BUFFER_BYTES 256
+
+static void put16(FILE *f, unsigned v) {
+  putc(v & 0XFF, f);
+  putc((v >> 8) & 0XFF, f);
+}
+
+static void put32(FILE *f, unsigned long v) {
+  put16(f, v & 0XFFFF);
+  put16(f, (v >> 16) & 0XFFFF);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: mktone [-f hz] [-r rate] [-s sec] TONE.WAV\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  double hz = 440;
+  unsigned long rate = 22050;
+  double seconds = 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:r:s:")) != -1) {
+    switch (opt) {
+    case 'f':
+      hz = atof(optarg);
+      break;
+    case 'r':
+      rate = atol(optarg);
+      break;
+    case 's':
+      seconds = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 1 || !rate) usage();
+
+  unsigned long data_size = (unsigned long)(rate * seconds) * 2
+      / BUFFER_BYTES * BUFFER_BYTES;
+  FILE *f = fopen(argv[optind], "wb");
+  if (!f) {
+    perror(argv[optind]);
+    return 1;
+  }
+  fwrite("RIFF", 1, 4, f);
+  put32(f, 36 + data_size);
+  fwrite("WAVEfmt ", 1, 8, f);
+  put32(f, 16);
+  put16(f, 1);         // PCM
+  put16(f, 1);         // mono
+  put32(f, rate);
+  put32(f, rate * 2);
+  put16(f, 2);
+  put16(f, 16);
+  fwrite("data", 1, 4, f);
+  put32(f, data_size);
+  for (unsigned long i = 0; i < data_size / 2; i++) {
+    int sample = (int)lround(16000 * sin(2 * M_PI * hz * i / rate));
+    put16(f, (unsigned)sample & 0XFFF0);
+  }
+  if (fclose(f)) {
+    perror(argv[optind]);
+    return 1;
+  }
+  printf("%s: %lu samples at %lu Hz\n", argv[optind], data_size / 2, rate);
+  return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * sim.cpp
+ *
+ * Virtual AVR core and Arduino library stand-ins for host builds.
+ * See sim.h.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "WProgram.h"
+#include "sim.h"
+
+uint64_t sim_cycles = 0;
+uint8_t sim_interrupts_enabled = 0;
+void (*sim_dispatch)(void) = 0;
+void (*sim_pin_hook)(uint8_t pin, uint8_t value) = 0;
+uint8_t sim_serial_quiet = 0;
+const char *sim_serial_input = 0;
+
+SimReg8 PINB, DDRB, PORTB;
+SimReg8 PINC, DDRC, PORTC;
+SimReg8 PIND, DDRD, PORTD;
+SimReg8 TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0, TIFR0;
+SimReg8 TCCR1A, TCCR1B, TIMSK1, TIFR1;
+SimReg16 TCNT1, OCR1A, OCR1B, ICR1;
+SimReg8 TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2, TIFR2, ASSR;
+SimReg8 GTCCR, SPCR, SPSR, SPDR, SREG;
+
+/*
+ * SREG only models the I bit so that the usual save, cli(), restore
+ * pattern works.
+ */
+static uint8_t sreg_read(void) {
+  return sim_interrupts_enabled ? 0x80 : 0;
+}
+static void sreg_write(uint8_t, uint8_t value) {
+  if (value & 0x80) {
+    sei();
+  } else {
+    sim_interrupts_enabled = 0;
+  }
+}
+static struct sreg_init {
+  sreg_init() {
+    SREG.on_read = sreg_read;
+    SREG.on_write = sreg_write;
+  }
+} sreg_init_;
+
+// Longest stretch of time that passes without checking for interrupts
+#define SIM_QUANTUM 16
+
+void sim_advance(uint32_t cycles) {
+  while (cycles) {
+    uint32_t step = cycles < SIM_QUANTUM ? cycles : SIM_QUANTUM;
+    sim_cycles += step;
+    cycles -= step;
+    if (sim_interrupts_enabled && sim_dispatch) (*sim_dispatch)();
+  }
+}
+
+void cli(void) {
+  sim_cycles += 1;
+  sim_interrupts_enabled = 0;
+}
+
+void sei(void) {
+  sim_cycles += 1;
+  sim_interrupts_enabled = 1;
+  if (sim_dispatch) (*sim_dispatch)();
+}
+
+/***********************************************************
+ *  Arduino core
+ ***********************************************************/
+
+static uint8_t pin_state[20];
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  sim_cycles += SIM_DIGITAL_WRITE_CYCLES;
+  if (pin < sizeof(pin_state)) pin_state[pin] = value;
+  if (sim_pin_hook) (*sim_pin_hook)(pin, value);
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < sizeof(pin_state) ? pin_state[pin] : LOW;
+}
+
+int analogRead(uint8_t) {
+  sim_advance(SIM_CYCLES(100));
+  return rand() & 0x3FF;
+}
+
+void analogWrite(uint8_t pin, int value) {
+  digitalWrite(pin, value >= 128 ? HIGH : LOW);
+}
+
+unsigned long millis(void) {
+  return (unsigned long)(sim_cycles / (F_CPU / 1000UL));
+}
+
+unsigned long micros(void) {
+  return (unsigned long)SIM_US(sim_cycles);
+}
+
+void delay(unsigned long ms) {
+  sim_advance(SIM_CYCLES(ms * 1000UL));
+}
+
+void delayMicroseconds(unsigned int us) {
+  sim_advance(SIM_CYCLES(us));
+}
+
+void randomSeed(unsigned int seed) {
+  srand(seed);
+}
+
+long random(long howbig) {
+  return howbig ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig) {
+  return howsmall + random(howbig - howsmall);
+}
+
+/***********************************************************
+ *  Serial
+ ***********************************************************/
+
+HardwareSerial Serial;
+
+static void print_number(unsigned long n, int base, uint8_t negative) {
+  char buf[8 * sizeof(long) + 2];
+  int i = sizeof(buf) - 1;
+  buf[i] = 0;
+  if (n == 0) buf[--i] = '0';
+  while (n) {
+    int digit = n % base;
+    buf[--i] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  }
+  if (negative) buf[--i] = '-';
+  Serial.print(&buf[i]);
+}
+
+int HardwareSerial::available(void) {
+  return sim_serial_input && *sim_serial_input;
+}
+
+int HardwareSerial::read(void) {
+  if (!available()) return -1;
+  return *sim_serial_input++;
+}
+
+void HardwareSerial::print(const char *s) {
+  if (!sim_serial_quiet) fputs(s, stdout);
+}
+
+void HardwareSerial::print(char c) {
+  if (!sim_serial_quiet) putchar(c);
+}
+
+void HardwareSerial::print(uint8_t b) {
+  print((char)b);
+}
+
+void HardwareSerial::print(int n, int base) {
+  print((long)n, base);
+}
+
+void HardwareSerial::print(unsigned int n, int base) {
+  print((unsigned long)n, base);
+}
+
+void HardwareSerial::print(long n, int base) {
+  if (base == DEC && n < 0) {
+    print_number(-n, base, 1);
+  } else {
+    print_number(base == DEC ? n : (unsigned long)n, base, 0);
+  }
+}
+
+void HardwareSerial::print(unsigned long n, int base) {
+  print_number(n, base, 0);
+}
+
+void HardwareSerial::println(void) {
+  print("\r\n");
+}
+
+void HardwareSerial::println(const char *s) {
+  print(s);
+  println();
+}
+
+void HardwareSerial::println(char c) {
+  print(c);
+  println();
+}
+
+void HardwareSerial::println(uint8_t b) {
+  print(b);
+  println();
+}
+
+void HardwareSerial::println(int n, int base) {
+  print(n, base);
+  println();
+}
+
+void HardwareSerial::println(unsigned int n, int base) {
+  print(n, base);
+  println();
+}
+
+void HardwareSerial::println(long n, int base) {
+  print(n, base);
+  println();
+}
+
+void HardwareSerial::println(unsigned long n, int base) {
+  print(n, base);
+  println();
+}
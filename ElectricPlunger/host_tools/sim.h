@@ -0,0 +1,103 @@
+/*
+ * sim.h
+ *
+ * A small virtual AVR for running the plunger libraries on a Linux host.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * Time is counted in cycles of F_CPU and only moves when the code under
+ * test touches an I/O register, calls an Arduino timing function, or when
+ * a harness calls sim_advance().  Each harness installs a dispatch
+ * function that runs the interrupts it models whenever time passes with
+ * interrupts enabled, so nested interrupts (such as the WaveHC refill
+ * interrupt re-enabling interrupts with sei()) behave as they do on the
+ * part.
+ */
+
+#ifndef sim_h
+#define sim_h
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 20000000UL
+#endif
+
+// Virtual CPU clock
+extern uint64_t sim_cycles;
+
+// The I bit of SREG
+extern uint8_t sim_interrupts_enabled;
+
+// Set by a harness to run any interrupts that are due.  Called with
+// interrupts enabled from sim_advance() and sei().
+extern void (*sim_dispatch)(void);
+
+// Let cycles pass, running any interrupts that become due.
+void sim_advance(uint32_t cycles);
+
+// Convert between cycles and microseconds
+#define SIM_US(cycles) ((cycles) / (F_CPU / 1000000UL))
+#define SIM_CYCLES(us) ((uint64_t)(us) * (F_CPU / 1000000UL))
+
+// Called for every digitalWrite()
+extern void (*sim_pin_hook)(uint8_t pin, uint8_t value);
+
+// Cost in cycles of one digitalWrite() on the part
+#define SIM_DIGITAL_WRITE_CYCLES 50
+
+/*
+ * An I/O register.  Reads cost one cycle, writes one cycle, and compound
+ * assignments two, close to in/out and sbi/cbi.  A harness can watch
+ * writes or compute the value returned by reads.
+ */
+template <typename T>
+class SimReg {
+ public:
+  SimReg() : value(0), on_write(0), on_read(0) {}
+
+  operator T() const {
+    sim_cycles += 1;
+    return on_read ? on_read() : value;
+  }
+  SimReg& operator=(unsigned long v) {
+    set(v);
+    return *this;
+  }
+  SimReg& operator|=(unsigned long v) {
+    set(get() | v);
+    return *this;
+  }
+  SimReg& operator&=(unsigned long v) {
+    set(get() & v);
+    return *this;
+  }
+  SimReg& operator^=(unsigned long v) {
+    set(get() ^ v);
+    return *this;
+  }
+  SimReg& operator+=(unsigned long v) {
+    set(get() + v);
+    return *this;
+  }
+
+  T get() const { return on_read ? on_read() : value; }
+  void set(unsigned long v) {
+    T old_value = value;
+    value = (T)v;
+    sim_cycles += 1;
+    if (on_write) on_write(old_value, value);
+  }
+
+  T value;
+  void (*on_write)(T old_value, T new_value);
+  T (*on_read)(void);
+};
+
+typedef SimReg<uint8_t> SimReg8;
+typedef SimReg<uint16_t> SimReg16;
+
+#endif  // sim_h
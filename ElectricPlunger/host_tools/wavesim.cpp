@@ -0,0 +1,550 @@
+/*
+ * wavesim.cpp
+ *
+ * Host-side render harness for the WaveHC library.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * Plays a .wav file from a FAT disk image through the unmodified WaveHC,
+ * FatReader and WaveUtil sources.  TIMER1 is simulated in virtual time:
+ * the sample interrupt (COMPA) fires every OCR1A + 1 cycles and the refill
+ * interrupt (COMPB) fires as soon as it is enabled, and both can nest
+ * inside SD reads exactly as they do on the plunger.
+ *
+ * The 16 bit words the sample interrupt clocks into the DAC are decoded
+ * from the port writes, or with WAVE_PWM_OUTPUT the PWM duty cycle is taken
+ * from OCR2B, and saved to a 16 bit mono .wav file, so changes to
+ * the storage or decoding paths can be checked bit for bit.  The harness
+ * also reports underruns, refill latency, interrupt counts and costs, and
+ * the time from opening a file to its first sample.  The "leds" chunks of
+ * a show made by mkshow are read through as the plunger driver reads
+ * them, from the refill.
+ *
+ * USAGE:
+ *
+ *   wavesim [options] image.img NAME.WAV [out.wav]
+ *
+ *   -c        also start the file from its cached WaveInfo and render
+ *             from that start
+ *   -e n      with -k, hold the first n entries of the bank's table in RAM
+ *   -k clip   NAME is a sound bank, play this clip from it
+ *   -l us     SD access time for each block read (default 300)
+ *   -p us     main loop work between WaveHC::pump() calls (default 1000),
+ *             0 never calls pump() so every refill is an interrupt
+ *   -s sec    stop after this many seconds of audio
+ *   -t file   write a CSV trace of refills, pumps and underruns
+ *   -v        show the library's serial output
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "WProgram.h"
+#include "SdReader.h"
+#include "FatReader.h"
+#include "WaveHC.h"
+#include "SoundBank.h"
+#include "SdReaderHost.h"
+#include "sim.h"
+
+extern "C" void TIMER1_COMPA_vect(void);
+extern "C" void TIMER1_COMPB_vect(void);
+extern volatile uint8_t doublebuffready;
+
+// Cost of entering and leaving an interrupt handler, register saves
+// included.  Port accesses inside the handler are counted as they happen.
+#define ISR_OVERHEAD_CYCLES 60
+
+// Time the main loop spends per pass while it waits for playback to end
+#define MAIN_LOOP_CYCLES 200
+
+// Time the main loop spends on other work between calls to pump()
+static uint64_t pump_period = SIM_CYCLES(1000);
+
+/***********************************************************
+ *  Statistics
+ ***********************************************************/
+
+struct span_stats {
+  uint32_t count;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+static void span_add(struct span_stats *s, uint64_t cycles) {
+  if (s->count == 0 || cycles < s->min) s->min = cycles;
+  if (cycles > s->max) s->max = cycles;
+  s->total += cycles;
+  s->count++;
+}
+
+static void span_print(const char *name, struct span_stats *s) {
+  if (s->count == 0) {
+    printf("%-18s none\n", name);
+    return;
+  }
+  printf("%-18s %lu, min/mean/max %llu/%llu/%llu us\n", name,
+         (unsigned long)s->count,
+         (unsigned long long)SIM_US(s->min),
+         (unsigned long long)SIM_US(s->total / s->count),
+         (unsigned long long)SIM_US(s->max));
+}
+
+static struct span_stats compa_stats;
+static struct span_stats compb_stats;
+static struct span_stats refill_latency;
+static struct span_stats pump_stats;
+static uint16_t min_deadline = 0XFFFF;
+static uint32_t missed_compares;
+static uint8_t nesting, max_nesting;
+static FILE *trace = 0;
+
+#if WAVE_ISR_PROFILE
+/* What the library's own profiler measured, in cycles. */
+static void profile_print(const char *name, IsrProfile *p) {
+  if (p->count == 0) {
+    printf("%-18s none\n", name);
+    return;
+  }
+  printf("%-18s %lu, min/mean/max %lu/%lu/%lu cycles\n", name,
+         (unsigned long)p->count, (unsigned long)p->min,
+         (unsigned long)(p->total / p->count), (unsigned long)p->max);
+}
+#endif  // WAVE_ISR_PROFILE
+
+/***********************************************************
+ *  TIMER1
+ ***********************************************************/
+
+static WaveHC wave;
+
+static uint8_t timer1_running;
+static uint64_t timer1_start;
+static uint64_t next_compa;
+static uint64_t refill_requested;
+static uint8_t in_compa, in_compb;
+
+static void tccr1b_write(uint8_t, uint8_t value) {
+  if ((value & 7) && !timer1_running) {
+    timer1_running = 1;
+    timer1_start = sim_cycles;
+    next_compa = 0;
+  } else if (!(value & 7)) {
+    timer1_running = 0;
+  }
+}
+
+static uint16_t tcnt1_read(void) {
+  if (!timer1_running) return TCNT1.value;
+  return (sim_cycles - timer1_start) % ((uint32_t)OCR1A.value + 1);
+}
+
+/* A compare A match is pending until dispatch() runs its interrupt. */
+static uint8_t tifr1_read(void) {
+  uint8_t flags = _BV(OCF1B);
+  if (timer1_running && next_compa && sim_cycles >= next_compa) {
+    flags |= _BV(OCF1A);
+  }
+  return flags;
+}
+
+static void run_isr(void (*vector)(void), uint8_t *active,
+                    struct span_stats *stats) {
+  uint64_t start = sim_cycles;
+  *active = 1;
+  if (++nesting > max_nesting) max_nesting = nesting;
+  sim_interrupts_enabled = 0;
+  sim_cycles += ISR_OVERHEAD_CYCLES / 2;
+  (*vector)();
+  sim_cycles += ISR_OVERHEAD_CYCLES / 2;
+  sim_interrupts_enabled = 1;  // reti
+  nesting--;
+  *active = 0;
+  span_add(stats, sim_cycles - start);
+}
+
+/*
+ * Run every interrupt that is due, highest priority first.  Compare match
+ * flags are sticky, so an enabled COMPB is always pending.
+ */
+static void dispatch(void) {
+  while (sim_interrupts_enabled && timer1_running) {
+    uint64_t period = (uint64_t)OCR1A.value + 1;
+    if (!next_compa) next_compa = timer1_start + period;
+
+    if (sim_cycles >= next_compa) {
+      uint64_t late = (sim_cycles - next_compa) / period;
+      next_compa += (late + 1) * period;
+      if ((TIMSK1.value & _BV(OCIE1A)) && !in_compa) {
+        // Matches that came and went while the interrupt was blocked
+        missed_compares += late;
+        uint32_t errors = wave.errors;
+        uint8_t was_ready = doublebuffready;
+        run_isr(TIMER1_COMPA_vect, &in_compa, &compa_stats);
+        if (was_ready && !doublebuffready) refill_requested = sim_cycles;
+        if (trace && wave.errors != errors) {
+          fprintf(trace, "underrun,%llu\n",
+                  (unsigned long long)SIM_US(sim_cycles));
+        }
+        continue;
+      }
+    }
+    if ((TIMSK1.value & _BV(OCIE1B)) && !in_compb) {
+      uint64_t start = sim_cycles;
+      run_isr(TIMER1_COMPB_vect, &in_compb, &compb_stats);
+      if (doublebuffready) {
+        span_add(&refill_latency, sim_cycles - refill_requested);
+        if (trace) {
+          fprintf(trace, "refill,%llu,%llu,%llu\n",
+                  (unsigned long long)SIM_US(refill_requested),
+                  (unsigned long long)SIM_US(start),
+                  (unsigned long long)SIM_US(sim_cycles));
+        }
+      }
+      continue;
+    }
+    break;
+  }
+}
+
+/***********************************************************
+ *  DAC capture
+ ***********************************************************/
+
+// MCP4921 wiring from dac.h
+#define DAC_CS_BIT    _BV(2)
+#define DAC_CLK_BIT   _BV(3)
+#define DAC_DI_BIT    _BV(4)
+#define DAC_LATCH_BIT _BV(5)
+
+static uint16_t dac_shift;
+static uint8_t dac_bits;
+static uint16_t dac_input;
+
+static int16_t *samples = 0;
+static uint32_t sample_count, sample_space;
+static uint64_t first_sample_time;
+
+static void emit_sample(int16_t value) {
+  if (sample_count == sample_space) {
+    sample_space = sample_space ? 2 * sample_space : 65536;
+    samples = (int16_t *)realloc(samples, sample_space * sizeof(int16_t));
+    if (!samples) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  if (sample_count == 0) first_sample_time = sim_cycles;
+  samples[sample_count++] = value;
+}
+
+/*
+ * Decode the bit-banged SPI transfer to the DAC.  Bits are clocked in on
+ * the rising edge of CLK while CS is low.  The input register is moved to
+ * the output when LATCH goes low, or as CS rises if LATCH is already low.
+ */
+static void portd_write(uint8_t old_value, uint8_t value) {
+  uint8_t rising = value & ~old_value;
+  uint8_t falling = old_value & ~value;
+
+  if (falling & DAC_CS_BIT) {
+    dac_shift = 0;
+    dac_bits = 0;
+  }
+  if ((rising & DAC_CLK_BIT) && !(value & DAC_CS_BIT)) {
+    dac_shift = (dac_shift << 1) | ((value & DAC_DI_BIT) ? 1 : 0);
+    dac_bits++;
+  }
+  if ((rising & DAC_CS_BIT) && dac_bits == 16) {
+    dac_input = dac_shift;
+    if (!(value & DAC_LATCH_BIT)) {
+      emit_sample((int16_t)(((dac_input & 0XFFF) - 0X800) << 4));
+    }
+  }
+  if (falling & DAC_LATCH_BIT) {
+    // 12 bit offset binary to 16 bit signed
+    emit_sample((int16_t)(((dac_input & 0XFFF) - 0X800) << 4));
+  }
+}
+
+/*
+ * With WAVE_PWM_OUTPUT each sample is a write to OCR2B from the sample
+ * interrupt.  The write that sets the idle level in play() isn't one.
+ */
+static void ocr2b_write(uint8_t, uint8_t value) {
+  if (in_compa) emit_sample((int16_t)((value - 0X80) << 8));
+}
+
+static void put16(FILE *f, uint16_t v) {
+  fputc(v & 0XFF, f);
+  fputc(v >> 8, f);
+}
+
+static void put32(FILE *f, uint32_t v) {
+  put16(f, v & 0XFFFF);
+  put16(f, v >> 16);
+}
+
+static uint8_t write_wav(const char *path, uint32_t rate) {
+  FILE *f = fopen(path, "wb");
+  if (!f) return 0;
+  uint32_t data_size = sample_count * 2;
+  fwrite("RIFF", 1, 4, f);
+  put32(f, 36 + data_size);
+  fwrite("WAVEfmt ", 1, 8, f);
+  put32(f, 16);
+  put16(f, 1);         // PCM
+  put16(f, 1);         // mono, the DAC sees stereo interleaved
+  put32(f, rate);
+  put32(f, rate * 2);
+  put16(f, 2);
+  put16(f, 16);
+  fwrite("data", 1, 4, f);
+  put32(f, data_size);
+  for (uint32_t i = 0; i < sample_count; i++) put16(f, samples[i]);
+  return fclose(f) == 0;
+}
+
+/***********************************************************
+ *  Show chunks
+ ***********************************************************/
+
+// "leds" chunks read, see LED_SHOW_CHUNK_ID in LedShow.h
+static uint32_t chunk_count;
+static uint32_t chunk_bytes;
+
+/* The chunk function: read a show's chunks as the driver does. */
+static uint32_t read_chunk(FatReader &f, const char *id, uint32_t size) {
+  if (strncmp(id, "leds", 4)) return 0;
+  uint8_t buf[64];
+  uint32_t done = 0;
+  while (done < size) {
+    uint16_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+    int16_t read = f.read(buf, n);
+    if (read <= 0) break;
+    done += read;
+  }
+  chunk_count++;
+  chunk_bytes += done;
+  return done;
+}
+
+/***********************************************************
+ *  Main
+ ***********************************************************/
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: wavesim [-c | -k clip [-e n]] [-l us] [-p us] [-s sec]"
+          " [-t trace.csv] [-v] image NAME.WAV [out.wav]\n");
+  exit(2);
+}
+
+static void fail(const char *msg) {
+  fprintf(stderr, "wavesim: %s\n", msg);
+  exit(1);
+}
+
+/* One pass of a sketch's loop(): pump the audio, then do other work. */
+static void main_loop_pass(void) {
+  if (!pump_period) {
+    sim_advance(MAIN_LOOP_CYCLES);
+    return;
+  }
+  uint16_t deadline = wave.refillDeadline();
+  uint64_t start = sim_cycles;
+  if (wave.pump()) {
+    if (deadline < min_deadline) min_deadline = deadline;
+    span_add(&pump_stats, sim_cycles - start);
+    span_add(&refill_latency, sim_cycles - refill_requested);
+    if (trace) {
+      fprintf(trace, "pump,%llu,%llu,%llu\n",
+              (unsigned long long)SIM_US(refill_requested),
+              (unsigned long long)SIM_US(start),
+              (unsigned long long)SIM_US(sim_cycles));
+    }
+  }
+  sim_advance(pump_period);
+}
+
+/* Run the main loop until the first sample reaches the DAC. */
+static uint64_t wait_first_sample(uint64_t start) {
+  while (sample_count == 0 && wave.isplaying) main_loop_pass();
+  if (sample_count == 0) fail("no samples played");
+  return first_sample_time - start;
+}
+
+int main(int argc, char **argv) {
+  uint8_t use_cache = 0;
+  long clip = -1;
+  uint16_t entries = 0;
+  double seconds = 0;
+  const char *out_path = 0;
+  int opt;
+
+  sim_serial_quiet = 1;
+  while ((opt = getopt(argc, argv, "ce:k:l:p:s:t:v")) != -1) {
+    switch (opt) {
+    case 'c':
+      use_cache = 1;
+      break;
+    case 'e':
+      entries = atol(optarg);
+      break;
+    case 'k':
+      clip = atol(optarg);
+      break;
+    case 'l':
+      sim_sd_command_cycles = SIM_CYCLES(atol(optarg));
+      break;
+    case 'p':
+      pump_period = SIM_CYCLES(atol(optarg));
+      break;
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 't':
+      trace = fopen(optarg, "w");
+      if (!trace) fail("can't open trace file");
+      fprintf(trace, "event,request_us,start_us,end_us\n");
+      break;
+    case 'v':
+      sim_serial_quiet = 0;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind < 2 || argc - optind > 3) usage();
+  if (use_cache && clip >= 0) usage();
+  if (argc - optind == 3) out_path = argv[optind + 2];
+
+  SdReader card;
+  FatVolume vol;
+  FatReader root;
+  FatReader file;
+  dir_t entry;
+  char name[13];
+
+  if (!sim_sd_open(argv[optind])) fail("can't open image");
+  if (!card.init()) fail("card init failed");
+  card.partialBlockRead(true);
+  if (!vol.init(card)) fail("no FAT volume in image");
+  if (!root.openRoot(vol)) fail("can't open root");
+  uint8_t found = 0;
+  uint64_t lookup_start = sim_cycles;
+  while (root.readDir(entry) > 0) {
+    dirName(entry, name);
+    if (!strcasecmp(name, argv[optind + 1])) {
+      found = 1;
+      break;
+    }
+  }
+  if (!found) fail("file not found in image");
+  uint64_t lookup_time = sim_cycles - lookup_start;
+
+  TCCR1B.on_write = tccr1b_write;
+  TCNT1.on_read = tcnt1_read;
+  TIFR1.on_read = tifr1_read;
+  PORTD.on_write = portd_write;
+  OCR2B.on_write = ocr2b_write;
+  sim_dispatch = dispatch;
+  sei();
+  wave.setChunkFunc(read_chunk);
+
+  SoundBank bank;
+  SoundBankEntry *table = new SoundBankEntry[entries + 1];
+  uint64_t start;
+  if (clip >= 0) {
+    // Open the bank ahead of time, as a player would, and time the clip
+    if (!file.open(vol, entry)) fail("can't open file");
+    if (!bank.open(file, table, entries)) fail("not a sound bank");
+    if (clip >= bank.count()) fail("no such clip in the bank");
+    start = sim_cycles;
+    if (!bank.play(wave, clip)) fail("can't play clip");
+  } else {
+    // Start the file the way the plunger does the first time it sees it
+    start = sim_cycles;
+    if (!file.open(vol, entry)) fail("can't open file");
+    if (!wave.create(file)) fail("not a valid WAV file");
+    wave.play();
+  }
+  uint64_t parsed_start = wait_first_sample(start);
+
+  WaveInfo info;
+  wave.getInfo(info);
+  uint64_t cached_start = 0;
+  if (use_cache) {
+    // Start again from the saved WaveInfo and keep this render
+    wave.stop();
+    sample_count = 0;
+    chunk_count = 0;
+    chunk_bytes = 0;
+    start = sim_cycles;
+    if (!file.open(vol, entry)) fail("can't reopen file");
+    if (!wave.create(file, info)) fail("create from WaveInfo failed");
+    wave.play();
+    cached_start = wait_first_sample(start);
+  }
+
+  uint64_t limit = seconds > 0 ? sim_cycles + (uint64_t)(seconds * F_CPU) : 0;
+  while (wave.isplaying && (!limit || sim_cycles < limit)) {
+    main_loop_pass();
+  }
+  if (wave.isplaying) wave.stop();
+
+  uint32_t rate = info.sampleRate * info.channels;
+  printf("%-18s %lu Hz, %u bit, %u channel, %lu data bytes at offset %lu\n",
+         "format", (unsigned long)info.sampleRate, info.bitsPerSample,
+         info.channels, (unsigned long)info.dataSize,
+         (unsigned long)info.dataOffset);
+  printf("%-18s %llu us\n", "directory lookup",
+         (unsigned long long)SIM_US(lookup_time));
+  printf("%-18s %llu us %s", "first sample",
+         (unsigned long long)SIM_US(parsed_start),
+         clip < 0 ? "with header parse"
+         : clip < bank.cached() ? "from the bank, entry in RAM"
+         : "from the bank, entry from the card");
+  if (use_cache) {
+    printf(", %llu us from WaveInfo",
+           (unsigned long long)SIM_US(cached_start));
+  }
+  printf("\n");
+  printf("%-18s %lu (%.2f s)\n", "samples", (unsigned long)sample_count,
+         (double)sample_count / rate);
+  printf("%-18s %lu\n", "underruns", (unsigned long)wave.errors);
+  printf("%-18s %lu\n", "missed compares", (unsigned long)missed_compares);
+  span_print("COMPA", &compa_stats);
+  span_print("COMPB", &compb_stats);
+  span_print("pump", &pump_stats);
+  span_print("refill latency", &refill_latency);
+#if WAVE_ISR_PROFILE
+  IsrProfile sample_profile, refill_profile, pump_profile;
+  wave.getProfile(sample_profile, refill_profile, pump_profile);
+  profile_print("COMPA profile", &sample_profile);
+  profile_print("COMPB profile", &refill_profile);
+  profile_print("pump profile", &pump_profile);
+#endif
+  if (pump_stats.count) {
+    printf("%-18s %u samples\n", "least pump slack", min_deadline);
+  }
+  printf("%-18s %u\n", "max nesting", max_nesting);
+  if (chunk_count) {
+    printf("%-18s %lu, %lu bytes\n", "leds chunks",
+           (unsigned long)chunk_count, (unsigned long)chunk_bytes);
+  }
+  printf("%-18s %lu block reads, %lu bytes\n", "SD",
+         (unsigned long)sim_sd_stats.commands,
+         (unsigned long)sim_sd_stats.bytes);
+
+  if (out_path && !write_wav(out_path, rate)) fail("can't write output");
+  if (trace) fclose(trace);
+  delete[] table;
+  return 0;
+}
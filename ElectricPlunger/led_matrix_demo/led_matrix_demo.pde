@@ -30,29 +30,29 @@ static void demo0() {
     Serial.println(state, DEC);
      switch(state) {
     case 0:
-      matrix.DisplayLeds("444444" 
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444");
+      matrix.DisplayLeds("999999" 
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999");
       break;
     case 1:
       matrix.DisplayLeds("000000"
                          "000000"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444"
-                         "444444");
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999"
+                         "999999");
       break;
     }
     if ((millis() - last_change) > 5000) {
@@ -71,7 +71,7 @@ static void demo1() {
   if (matrix.IsReady()) {
      switch(state) {
     case 0:
-      matrix.DisplayLeds("111111" 
+      matrix.DisplayLeds("999999" 
                          "000000" 
                          "000000" 
                          "000000" 
@@ -83,40 +83,40 @@ static void demo1() {
                          "000000");
       break;
     case 1:
-      matrix.DisplayLeds("100000" 
-                         "100000" 
-                         "010000" 
-                         "010000" 
-                         "001000"
-                         "001000" 
-                         "000100" 
-                         "000100" 
-                         "000010" 
-                         "000010");
+      matrix.DisplayLeds("900000" 
+                         "900000" 
+                         "090000" 
+                         "090000" 
+                         "009000"
+                         "009000" 
+                         "000900" 
+                         "000900" 
+                         "000090" 
+                         "000090");
       break;
     case 2:
-      matrix.DisplayLeds("001000" 
-                         "000100" 
-                         "000100" 
-                         "000010" 
-                         "000010"
-                         "100000" 
-                         "100000" 
-                         "010000" 
-                         "010000" 
-                         "001000");
+      matrix.DisplayLeds("009000" 
+                         "000900" 
+                         "000900" 
+                         "000090" 
+                         "000090"
+                         "900000" 
+                         "900000" 
+                         "090000" 
+                         "090000" 
+                         "009000");
       break;
     case 3:
-      matrix.DisplayLeds("111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111" 
-                         "111111");
+      matrix.DisplayLeds("999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999" 
+                         "999999");
       break;
     default:
       state = 0;
@@ -183,4 +183,4 @@ static void demo2() {
     }
   }
 }
-
+
@@ -9,6 +9,9 @@
  */
 
 #include <LedMatrix.h>
+#include <LedEffect.h>
+#include <LedSpectrum.h>
+#include <LedShow.h>
 #include <FatReader.h>
 #include <SdReader.h>
 #include <avr/pgmspace.h>
@@ -52,7 +55,6 @@ static void sdErrorCheck(void)
 }
 
 static bool isWavFile(dir_t&); // decl
-static bool isLedFile(dir_t&); // decl
 
 static bool FindNextWavFile(FatReader& dir, int* last_index) {
   int index = 0;
@@ -70,22 +72,6 @@ static bool FindNextWavFile(FatReader& dir, int* last_index) {
   return false;
 }
 
-static bool FindNextLedFile(FatReader& dir, int* last_index) {
-  int index = 0;
-  dir.rewind();
-  while (dir.readDir(dirBuf) > 0) {
-    if (dirBuf.name[0] == '.' || !isLedFile(dirBuf))
-      continue;
-    index++;
-    if (index > *last_index) {
-      *last_index = index;
-      return true;
-    }
-  }
-  *last_index = 0;
-  return false;
-}
-
 /* Pretty prints a FAT 8.3 filename */
 static void printName(dir_t &dir)
 {
@@ -129,6 +115,7 @@ static void wave_play_loop() {
   }
   // sdErrorCheck();
   if (FindNextWavFile(wstate.root, &next_wav_index)) {
+    led_wav_start();
     if (!wstate.wave_file.open(vol, dirBuf)) {
       // Serial.print("Failed to open WAV file: ");
       // printName(dirBuf);
@@ -142,25 +129,139 @@ static void wave_play_loop() {
 #endif
       wave.play();
     }
+    led_wav_started();
+  }
+}
+
+/***********************************************************
+ *  Show clock
+ ***********************************************************/
+
+/*
+ * Milliseconds of show time.  While a .wav file is playing the clock is
+ * driven by the count of samples the DAC has sent, so LED frames stay
+ * locked to the audio however long the file is.  Between files it falls
+ * back to millis().
+ */
+struct show_clock {
+  uint32_t last_samples;
+  unsigned long last_millis;
+  uint32_t sample_remainder;  // samples * 1000 not yet counted as a ms
+  unsigned long now;
+};
+static struct show_clock sclock;
+
+static unsigned long show_time() {
+  uint32_t samples = wave.samplesPlayed();
+  unsigned long ms = millis();
+
+  if (wave.isplaying) {
+    uint32_t rate = wave.dwSamplesPerSec * wave.Channels;
+    sclock.sample_remainder += (samples - sclock.last_samples) * 1000;
+    sclock.now += sclock.sample_remainder / rate;
+    sclock.sample_remainder %= rate;
+  } else {
+    sclock.now += ms - sclock.last_millis;
+    sclock.sample_remainder = 0;
   }
+  sclock.last_samples = samples;
+  sclock.last_millis = ms;
+  return sclock.now;
 }
 
 /***********************************************************
  *  LED Matrix control logic
  ***********************************************************/
 
-struct led_state {
-  FatReader led_file;
-  unsigned long last_action_time;
-  int time_to_next_read;
+// If the show falls further behind than this, skip ahead instead of 
+// racing through the missed frames.
+#define LED_MAX_LAG 1000
 
-  // Each line is 4 chars of millisecond duration + 60 chars of LED data + n/l
+// Each line is 4 chars of millisecond duration + 60 chars of LED data + n/l
 #define LINE_BUF_SIZE 65
-  char line_buf[LINE_BUF_SIZE];
+
+// Frames decoded ahead of the show, packed.  The file itself is read
+// ahead into the stream below, so this only needs to hold the frame a
+// transition is heading for and the one a delta changes.
+#define LED_QUEUE_LEN 2
+
+// Bytes of the LED file read ahead into RAM.  Half a block of the card: a
+// whole one doesn't fit beside WaveHC's play buffers.  It holds two leds
+// chunks of a show in a .wav.
+#define LED_STREAM_SIZE 256
+// The stream is read when at least this much of it is free, about 2 lines
+// of a .led file or 10 on/off frames of a .LEB file a read
+#define LED_STREAM_CHUNK 128
+
+// What reading a line or record from the stream came to
+#define LED_READ_OK 1
+#define LED_READ_WAIT 0  // not all in the stream yet
+#define LED_READ_END -1  // end of the file or an error
+
+// Where the LED data comes from, lstate.source
+#define LED_FROM_FILES 0  // .led and .LEB files in turn
+#define LED_FROM_WAV 1    // a .wav is starting and may have a show in it
+#define LED_FROM_SHOW 2   // the leds chunks of the .wav playing
+
+// The stream has room for a show's next leds chunk while it plays the
+// last one
+typedef char show_chunk_size_check[
+    LED_STREAM_SIZE >= 2 * LED_SHOW_CHUNK_SIZE ? 1 : -1];
+
+struct led_state {
+  // The refill interrupt can end a show, see led_show_chunk()
+  volatile uint8_t source;
+  FatReader led_file;
+  // The file is a compiled .LEB show rather than .led text
+  bool binary;
+  // A .LEB loop being played from the stream, where it stays until the
+  // last play: the length of its records, where the next one starts and
+  // the plays left
+  uint8_t loop_len;
+  uint8_t loop_pos;
+  uint8_t loop_plays;
+  // Show time at which the current frame ends
+  unsigned long frame_end_time;
+
+  LedShowEntry queue[LED_QUEUE_LEN];
+  uint8_t queue_head;
+  uint8_t queue_count;
   FatReader root;
+
+  // The effect running until frame_end_time, if any
+  LedEffect effect;
+  bool effect_running;
+  unsigned long effect_start_time;
+  unsigned int effect_step;
+  // The last frame read from the card, for effects that move it
+  LedFrame last_frame;
+  // The last refill the audio effect was drawn from
+  uint16_t audio_refill;
 };
 
 struct led_state lstate;
+
+/*
+ * A ring of the bytes of the LED file that haven't been used yet.  During
+ * a show the refill interrupt adds to count, so loop() changes it and
+ * head with interrupts off and reads it with led_stream_count().
+ */
+struct led_stream {
+  uint8_t buf[LED_STREAM_SIZE];
+  uint16_t head;            // the first byte not used
+  volatile uint16_t count;  // bytes read and not used
+  bool eof;                 // the whole file has been read, or a read failed
+};
+
+struct led_stream lstream;
+
+// Bars for the audio effect
+LedSpectrum spectrum;
+
+#if WAVE_ISR_PROFILE
+// Cycles taken by each spectrum analysis, timed with micros()
+static IsrProfile spectrum_profile;
+#endif
 // ApuPlunger pin outs
 
 // LED Matrix
@@ -174,62 +275,467 @@ static bool isLedFile(dir_t &dir)
   if (DIR_IS_SUBDIR(dir)) {
     return false;
   }
-  if (dir.name[8] == 'L' && dir.name[9] == 'E' && dir.name[10] == 'D') {
+  if (dir.name[8] == 'L' && dir.name[9] == 'E'
+      && (dir.name[10] == 'D' || dir.name[10] == 'B')) {
     return true;
   }
   return false;
 }
 
-// Read the next line of data from the file.
-static void read_next_line() {
+/*
+ * readDir() while a .wav may be playing.  The refill interrupt is held off
+ * the card for one entry at a time, not the whole walk of the directory,
+ * which on a card with many files would outlast the play buffer.
+ */
+static int8_t led_read_dir(FatReader& dir) {
+  wave.pump();
+  wave.holdRefill();
+  int8_t result = dir.readDir(dirBuf);
+  wave.releaseRefill();
+  return result;
+}
+
+static bool FindNextLedFile(FatReader& dir, int* last_index) {
+  int index = 0;
+  dir.rewind();
+  while (led_read_dir(dir) > 0) {
+    if (dirBuf.name[0] == '.' || !isLedFile(dirBuf))
+      continue;
+    index++;
+    if (index > *last_index) {
+      *last_index = index;
+      return true;
+    }
+  }
+  *last_index = 0;
+  return false;
+}
+
+// Forget what was read of the last file.
+static void led_stream_reset() {
+  noInterrupts();
+  lstream.head = 0;
+  lstream.count = 0;
+  interrupts();
+  lstream.eof = false;
+}
+
+static uint16_t led_stream_count() {
+  noInterrupts();
+  uint16_t count = lstream.count;
+  interrupts();
+  return count;
+}
+
+/*
+ * Read the next chunk of the LED file into the stream: as much as fits
+ * without wrapping around the ring or crossing a block of the card, so
+ * one block read at most.  Interrupts stay on; the audio is refilled
+ * first and WaveHC's refill interrupt is held off the card for the read.
+ */
+static void led_stream_fill() {
+  uint16_t tail = (lstream.head + lstream.count) % LED_STREAM_SIZE;
+  uint16_t n = LED_STREAM_SIZE - lstream.count;
+  if (n > LED_STREAM_SIZE - tail) {
+    n = LED_STREAM_SIZE - tail;
+  }
+  uint16_t left = LED_SHOW_SECTOR
+      - lstate.led_file.readPosition() % LED_SHOW_SECTOR;
+  if (n > left) {
+    n = left;
+  }
+  if (!n || lstream.eof) {
+    return;
+  }
+
+  wave.pump();
+  wave.holdRefill();
+  int16_t result = lstate.led_file.read(lstream.buf + tail, n);
+  wave.releaseRefill();
+
+  if (result > 0) {
+    lstream.count += result;
+  }
+  // A short read is the end of the file
+  if (result != (int16_t)n) {
+    lstream.eof = true;
+  }
+}
+
+// Copy n bytes from offset bytes into the stream, which must hold them.
+static void led_stream_copy(uint16_t offset, uint8_t *dst, uint8_t n) {
+  uint16_t pos = (lstream.head + offset) % LED_STREAM_SIZE;
+  for (uint8_t i = 0; i < n; i++) {
+    dst[i] = lstream.buf[pos];
+    pos = (pos + 1) % LED_STREAM_SIZE;
+  }
+}
+
+// Mark n bytes of the stream as used.
+static void led_stream_skip(uint16_t n) {
   noInterrupts();
-  int result = lstate.led_file.read((uint8_t*)lstate.line_buf, 
-                                      LINE_BUF_SIZE);
+  lstream.head = (lstream.head + n) % LED_STREAM_SIZE;
+  lstream.count -= n;
   interrupts();
+}
+
+// LED_READ_WAIT if more of the file or show is coming, else LED_READ_END
+static int8_t led_stream_short() {
+  bool more = lstate.source == LED_FROM_SHOW ? wave.isplaying : !lstream.eof;
+  return more ? LED_READ_WAIT : LED_READ_END;
+}
+
+static bool show_header_ok(const uint8_t *header) {
+  return !memcmp(header, LED_SHOW_MAGIC, 4)
+      && header[4] >= 1 && header[4] <= LED_SHOW_VERSION
+      && header[5] == LED_NUM_ROWS && header[6] == LED_NUM_COLS;
+}
+
+// Check the header of a .LEB file that has just been opened.
+static bool read_show_header() {
+  uint8_t header[LED_SHOW_HEADER_SIZE];
+  led_stream_fill();
+  if (lstream.count < sizeof(header)) {
+    return false;
+  }
+  led_stream_copy(0, header, sizeof(header));
+  led_stream_skip(sizeof(header));
+  return show_header_ok(header);
+}
+
+/*
+ * Called before the next .wav file is opened.  A show's LEDs end with its
+ * audio.  The new file's first leds chunk, if it has one, takes them over
+ * while it starts, see led_show_chunk().
+ */
+static void led_wav_start() {
+  if (lstate.source == LED_FROM_SHOW) {
+    led_stream_reset();
+  }
+  lstate.source = LED_FROM_WAV;
+}
+
+// Called once the .wav file has started, or failed to.
+static void led_wav_started() {
+  if (lstate.source == LED_FROM_WAV) {
+    lstate.source = LED_FROM_FILES;
+  }
+}
 
-  if (result != LINE_BUF_SIZE) {
-    // EOF or error
+/*
+ * WaveHC's chunk function: takes the leds chunks of a show in a .wav into
+ * the stream, see LedShow.h.  The first one comes before the audio, so it
+ * is met by wave.create() or wave.play() in wave_play_loop(), which is
+ * when the show takes over the LEDs.  The others come with refills, from
+ * pump() or the refill interrupt, and are only added to the stream.
+ */
+static uint32_t led_show_chunk(FatReader &f, const char *id, uint32_t size) {
+  if (strncmp(id, LED_SHOW_CHUNK_ID, 4)) {
+    return 0;
+  }
+  uint32_t used = 0;
+  if (lstate.source == LED_FROM_WAV) {
+    uint8_t header[LED_SHOW_HEADER_SIZE];
+    if (size < sizeof(header)
+        || f.read(header, sizeof(header)) != sizeof(header)) {
+      return 0;
+    }
+    used = sizeof(header);
+    if (!show_header_ok(header)) {
+      return used;
+    }
+    lstate.led_file.close();
+    lstate.source = LED_FROM_SHOW;
+    lstate.binary = true;
+    lstate.loop_plays = 0;
+    lstate.queue_count = 0;
+    lstate.effect_running = false;
+    lstate.frame_end_time = show_time();
+    led_stream_reset();
+  } else if (lstate.source != LED_FROM_SHOW) {
+    return 0;
+  }
+
+  while (used < size && lstream.count < LED_STREAM_SIZE) {
+    uint16_t tail = (lstream.head + lstream.count) % LED_STREAM_SIZE;
+    uint16_t n = LED_STREAM_SIZE - lstream.count;
+    if (n > LED_STREAM_SIZE - tail) {
+      n = LED_STREAM_SIZE - tail;
+    }
+    if (n > size - used) {
+      n = size - used;
+    }
+    int16_t result = f.read(lstream.buf + tail, n);
+    if (result <= 0) {
+      break;
+    }
+    lstream.count += result;
+    used += result;
+  }
+  if (used < size) {
+    // The rest doesn't fit, or couldn't be read, and the stream would go
+    // on partway through a record.  The show stops here; what is queued
+    // still plays and then the .led files take over.
+    lstate.source = LED_FROM_FILES;
+  }
+  return used;
+}
+
+// Take a line of a .led file from the stream into entry.
+static int8_t read_text_line(LedShowEntry *entry) {
+  char line_buf[LINE_BUF_SIZE];
+
+  if (led_stream_count() < LINE_BUF_SIZE) {
 #if DEBUG
-    Serial.print("Got result: ");
-    Serial.print(result, DEC);
-    Serial.println(".  Going to next file");
+    if (lstream.eof) {
+      Serial.print("Got result: ");
+      Serial.print(lstream.count, DEC);
+      Serial.println(".  Going to next file");
+    }
 #endif
-    lstate.led_file.close();
+    return led_stream_short();
+  }
+  led_stream_copy(0, (uint8_t*)line_buf, LINE_BUF_SIZE);
+  led_stream_skip(LINE_BUF_SIZE);
+
+  // The first 4 chars are the time in milliseconds to display this data
+  // The next 60 chars are the led values [0-9], or an effect
+  entry->duration = 
+      (line_buf[0] - '0') * 1000 +
+      (line_buf[1] - '0') * 100 +
+      (line_buf[2] - '0') * 10 +
+      (line_buf[3] - '0');
+  entry->is_effect = entry->effect.Parse(&line_buf[4]);
+  if (!entry->is_effect) {
+    LedMatrix::PackFrame(&line_buf[4], &entry->frame);
   }
+  return LED_READ_OK;
+}
 
-  lstate.time_to_next_read = 
-      (lstate.line_buf[0] - '0') * 1000 +
-      (lstate.line_buf[1] - '0') * 100 +
-      (lstate.line_buf[2] - '0') * 10 +
-      (lstate.line_buf[3] - '0');
+/*
+ * Decode the next record of the loop being played.  Its records stay in
+ * the stream after the loop record until the last play.
+ */
+static int8_t next_loop_record(const LedShowEntry *previous,
+                               LedShowEntry *entry) {
+  uint8_t record[LED_SHOW_MAX_RECORD];
+  uint8_t left = lstate.loop_len - lstate.loop_pos;
+  uint8_t n = left < sizeof(record) ? left : sizeof(record);
+  led_stream_copy(3 + lstate.loop_pos, record, n);
+  uint8_t size = LedShowRecordSize(record, n);
+  if (!size || size > left || record[0] == LED_SHOW_LOOP) {
+    lstate.loop_plays = 0;
+    return LED_READ_END;
+  }
+  lstate.loop_pos += size;
+  if (lstate.loop_pos >= lstate.loop_len) {
+    lstate.loop_pos = 0;
+    if (--lstate.loop_plays == 0) {
+      led_stream_skip(3 + lstate.loop_len);
+    }
+  }
+  return LedShowDecode(record, previous, entry)
+      ? LED_READ_OK : LED_READ_END;
 }
 
-static void led_loop() {
-  matrix.RunStateMachine();
+/*
+ * Take a record of a .LEB file from the stream into entry, see LedShow.h.
+ * A loop waits until all its records are in the stream, and is then
+ * played from there.
+ */
+static int8_t read_show_record(LedShowEntry *entry) {
+  const LedShowEntry *previous = &lstate.queue[
+      (lstate.queue_head + lstate.queue_count + LED_QUEUE_LEN - 1)
+      % LED_QUEUE_LEN];
+  if (lstate.loop_plays) {
+    return next_loop_record(previous, entry);
+  }
+
+  // Padding to the end of a block.  No record starts with a zero.
+  while (led_stream_count()
+         && lstream.buf[lstream.head] == LED_SHOW_PAD) {
+    led_stream_skip(1);
+  }
+
+  uint8_t record[LED_SHOW_MAX_RECORD];
+  uint16_t count = led_stream_count();
+  uint8_t n = count < LED_SHOW_HEAD_SIZE ? count : LED_SHOW_HEAD_SIZE;
+  led_stream_copy(0, record, n);
+  uint8_t size = LedShowRecordSize(record, n);
+  if (!size) {
+    // Too short to tell, or not a record
+    return n < LED_SHOW_HEAD_SIZE ? led_stream_short() : LED_READ_END;
+  }
+  uint8_t more = record[0] == LED_SHOW_LOOP ? record[2] : 0;
+  if (count < (uint16_t)size + more) {
+    return led_stream_short();
+  }
+
+  if (record[0] == LED_SHOW_LOOP) {
+    lstate.loop_len = more;
+    lstate.loop_pos = 0;
+    lstate.loop_plays = record[1];
+    return next_loop_record(previous, entry);
+  }
+  led_stream_copy(0, record, size);
+  led_stream_skip(size);
+  return LedShowDecode(record, previous, entry)
+      ? LED_READ_OK : LED_READ_END;
+}
+
+// Take the next line or record from the stream onto the end of the queue.
+static void read_next_line() {
+  LedShowEntry *entry = &lstate.queue[
+      (lstate.queue_head + lstate.queue_count) % LED_QUEUE_LEN];
+
+  int8_t result = lstate.binary
+      ? read_show_record(entry) : read_text_line(entry);
+  if (result != LED_READ_END) {
+    if (result == LED_READ_OK) {
+      lstate.queue_count++;
+    }
+    return;
+  }
+  noInterrupts();
+  bool show = lstate.source == LED_FROM_SHOW;
+  if (show && !wave.isplaying) {
+    lstate.source = LED_FROM_FILES;
+  }
+  interrupts();
+  if (show) {
+    // The show is over, or a record was bad.  A bad one loses what is
+    // buffered, and the show picks up again at its next chunk.
+    lstate.loop_plays = 0;
+    led_stream_skip(led_stream_count());
+    return;
+  }
+  // EOF or error
+  lstate.led_file.close();
+}
 
-  if (!matrix.IsReady()) {
+/*
+ * Update the audio effect's bars from the buffer WaveHC read last, if
+ * there is a new one.  It isn't written again until it has played, which
+ * leaves more than the time of a buffer for the analysis.  The bars fall
+ * when nothing is playing.  Returns false if nothing changed.
+ */
+static bool led_audio_analyze() {
+  const uint8_t *data;
+  uint16_t len;
+  uint16_t refill = wave.lastRefill(data, len);
+  if (!wave.isplaying) {
+    len = 0;
+  } else if (refill == lstate.audio_refill) {
+    return false;
+  }
+  lstate.audio_refill = refill;
+
+#if WAVE_ISR_PROFILE
+  unsigned long start = micros();
+#endif
+  spectrum.Analyze(data, len, wave.BitsPerSample);
+#if WAVE_ISR_PROFILE
+  if (len) {
+    profileRecord(&spectrum_profile,
+                  (micros() - start) * (F_CPU / 1000000UL));
+  }
+#endif
+  return true;
+}
+
+// Draw the effect's step for the show time, if it has moved on.
+static void led_effect_step(unsigned long now) {
+  unsigned int step = (now - lstate.effect_start_time) 
+      / lstate.effect.StepMs();
+  if (step == lstate.effect_step) {
     return;
   }
+  LedFrame frame;
+  if (lstate.effect.Type() == LED_EFFECT_TRANSITION) {
+    // Toward the frame at the head of the queue, which is shown when the
+    // transition ends.  Until it has been read, or if the next line is an
+    // effect, the last frame is held.
+    LedShowEntry *next = &lstate.queue[lstate.queue_head];
+    bool have_next = lstate.queue_count > 0 && !next->is_effect;
+    unsigned int steps = (lstate.frame_end_time - lstate.effect_start_time)
+        / lstate.effect.StepMs();
+    lstate.effect.Transition(step, steps, lstate.last_frame, 
+                             have_next ? next->frame : lstate.last_frame,
+                             &frame);
+  } else if (lstate.effect.Type() == LED_EFFECT_AUDIO) {
+    // At most one analysis a step, however often the buffer is refilled
+    if (!led_audio_analyze()) {
+      return;
+    }
+    spectrum.Render(lstate.effect.Level(), &frame);
+  } else {
+    lstate.effect.Render(step, lstate.last_frame, &frame);
+  }
+  matrix.DisplayFrame(frame);
+  lstate.effect_step = step;
+}
+
+static void led_loop() {
+  matrix.RunStateMachine();
 
-  long unsigned int elapsed = millis() - lstate.last_action_time;
-  if (elapsed < lstate.time_to_next_read) {
-    // Display the current LED data
+  if (lstate.source == LED_FROM_SHOW || lstate.led_file.isOpen()) {
+    // Read the file a chunk at a time, whenever there's room for one,
+    // rather than a frame at a time as each is due.  A show's chunks
+    // come with the audio.
+    if (lstate.source == LED_FROM_FILES && !lstream.eof
+        && LED_STREAM_SIZE - lstream.count >= LED_STREAM_CHUNK) {
+      led_stream_fill();
+    }
+    // Keep the queue topped up 
+    if (lstate.queue_count < LED_QUEUE_LEN) {
+      read_next_line();
+    }
+  }
 
-    // The first 4 chars are the time in milliseconds to display this data
-    // The next 60 chars are the led values [0-9]
-    matrix.DisplayLeds(&lstate.line_buf[4]);
+  unsigned long now = show_time();
+  if ((long)(now - lstate.frame_end_time) < 0) {
+    // The matrix keeps showing the current LED data, or the next step of
+    // the effect
+    if (lstate.effect_running) {
+      led_effect_step(now);
+    }
     return;
   }
+  lstate.effect_running = false;
 
   // The time to expire the current set of data has expired.
-  lstate.last_action_time = millis();
-  if (lstate.led_file.isOpen()) {
-    read_next_line();    
+  if (lstate.queue_count > 0) {
+    LedShowEntry *entry = &lstate.queue[lstate.queue_head];
+    // Schedule from the end of the last frame rather than from now so 
+    // that the delay in getting here does not accumulate.
+    if ((long)(now - lstate.frame_end_time) > LED_MAX_LAG) {
+      lstate.frame_end_time = now;
+    }
+    if (entry->is_effect) {
+      lstate.effect = entry->effect;
+      lstate.effect_running = true;
+      lstate.effect_start_time = lstate.frame_end_time;
+      // Not a step number, so the first step is drawn
+      lstate.effect_step = 0xFFFF;
+    } else {
+      matrix.DisplayFrame(entry->frame);
+      lstate.last_frame = entry->frame;
+    }
+    lstate.frame_end_time += entry->duration;
+    lstate.queue_head = (lstate.queue_head + 1) % LED_QUEUE_LEN;
+    lstate.queue_count--;
+    // Once the line's end time is known and the line after it is at the
+    // head of the queue, which transitions need
+    if (lstate.effect_running) {
+      led_effect_step(now);
+    }
+    return;
+  }
+  if (lstate.source == LED_FROM_SHOW || lstate.led_file.isOpen()) {
     return;
   }
 
   // No more data in this file.  Open the next file 
-  noInterrupts();
   while (1) {
     // Will return false when we reach the end.
     if (!FindNextLedFile(lstate.root, &next_led_index))
@@ -243,7 +749,12 @@ static void led_loop() {
     // We have a new file open now.
     break;
   }
-  interrupts();
+  lstate.binary = dirBuf.name[10] == 'B';
+  lstate.loop_plays = 0;
+  led_stream_reset();
+  if (lstate.binary && !read_show_header()) {
+    lstate.led_file.close();
+  }
 }
 
 static void busy_func() {
@@ -262,6 +773,57 @@ static void GetFileCounts(FatReader& dir, int* wav_count, int* led_count) {
   }
 }
 
+#if WAVE_ISR_PROFILE
+/***********************************************************
+ *  Audio interrupt profile
+ ***********************************************************/
+
+/* Prints one interrupt's timing in cycles, then its histogram. */
+static void print_isr_profile(const char* name, IsrProfile& p) {
+  Serial.print(name);
+  putstring(": count ");
+  Serial.print(p.count, DEC);
+  if (p.count) {
+    putstring(" min ");
+    Serial.print(p.min, DEC);
+    putstring(" mean ");
+    Serial.print(p.total / p.count, DEC);
+    putstring(" max ");
+    Serial.print(p.max, DEC);
+    putstring(" (");
+    Serial.print(p.max / (F_CPU / 1000000UL), DEC);
+    putstring(" us)");
+  }
+  Serial.println();
+  for (uint8_t i = 0; i < ISR_PROFILE_BUCKETS; i++) {
+    if (!p.histogram[i])
+      continue;
+    putstring("  >= ");
+    Serial.print(1UL << i, DEC);
+    putstring(": ");
+    Serial.println(p.histogram[i], DEC);
+  }
+}
+
+/* 
+ * Send 'p' on the serial port to print the cycles used by the sample and
+ * refill interrupts, by the refills from pump(), and by the audio effect's analysis of each buffer,
+ * since the last report.
+ */
+static void profile_loop() {
+  if (!Serial.available() || Serial.read() != 'p')
+    return;
+  IsrProfile sample, refill, pump;
+  wave.getProfile(sample, refill, pump);
+  wave.clearProfile();
+  print_isr_profile("sample", sample);
+  print_isr_profile("refill", refill);
+  print_isr_profile("pump", pump);
+  print_isr_profile("spectrum", spectrum_profile);
+  memset(&spectrum_profile, 0, sizeof(spectrum_profile));
+}
+#endif // WAVE_ISR_PROFILE
+
 /******************************************************************************
  *  Main Entry Points
  *****************************************************************************/
@@ -346,12 +908,27 @@ void setup() {
   Serial.println(next_led_index);
 #endif
 
+  // The busy hooks keep the LEDs refreshed through any card reads that
+  // are done with interrupts off.
   wstate.wave_file.setBusyFunc(busy_func);
   card.setBusyFunc(busy_func);
+  // Shows in .wav files feed the LEDs from the audio file
+  wave.setChunkFunc(led_show_chunk);
+#if WAVE_PWM_OUTPUT
+  // Timer2 plays the audio, so the LEDs are refreshed by RunStateMachine()
+  // from led_loop() and the busy hooks instead.
+#else
+  // Refresh the LEDs from Timer2, however long loop() is busy
+  matrix.StartRefreshTimer();
+#endif
 }
 
 
 void loop() {
   wave_play_loop();
+  wave.pump();
   led_loop();
+#if WAVE_ISR_PROFILE
+  profile_loop();
+#endif
 }
@@ -0,0 +1,337 @@
+/*
+ * LedEffect.h
+ *
+ * Animations for the LED matrix drawn from a few parameters instead of
+ * being read frame by frame from the card.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * An effect is described by a short string, the same 60 characters that
+ * would otherwise hold the LEDs on a line of a .led file:
+ *
+ *   character 0     the effect, one of the letters below
+ *   characters 1-4  milliseconds per step, 4 digits
+ *   character 5     brightness, a digit '1' to '9' as in DisplayLeds()
+ *   character 6     direction, 'U', 'D', 'L' or 'R', or for sparkle a
+ *                   digit, the number of LEDs in 10 lit at each step, or
+ *                   for a transition 'H', 'L' or 'X'
+ *
+ * The rest is ignored.  So "6000C00809D" followed by 49 spaces on a .led
+ * line runs a chase down the matrix at 80ms a step for 6 seconds.
+ *
+ *   S  scroll: the frame shown before the effect moves a row or column
+ *      each step, wrapping around
+ *   W  wipe: rows or columns light one at a time across the matrix, then
+ *      go dark in the same order
+ *   C  chase: a row or column runs across the matrix with a fading tail,
+ *      wrapping around
+ *   K  sparkle: random LEDs at random brightness up to the given one
+ *   F  fill: LEDs light one at a time, a row (U, D) or column (L, R) at a
+ *      time, until the matrix is full, then it starts over
+ *   B  bounce: one LED moves diagonally, bouncing off the edges
+ *   A  audio: a bar graph of the sound playing, from LedSpectrum.h, redrawn
+ *      at most once a step.  The sketch draws it; Render() leaves the
+ *      frame dark.  The direction is ignored.
+ *   T  transition: from the frame on the line before to the frame on the
+ *      line after, for which the direction is one of
+ *        H  hold: the frame before stays until the frame after is due
+ *        L  linear fade: each LED steps evenly from its level in the
+ *           frame before to its level in the frame after
+ *        X  crossfade: the frame before dims while the frame after
+ *           brightens, each LED at the brighter of the two, so halfway
+ *           both frames show at half brightness and an LED lit in both
+ *           dips rather than holding steady as it does for L
+ *      The brightness is ignored; the levels come from the two frames.  If
+ *      the line after isn't a frame the one before is held.  The sketch
+ *      draws it with Transition(); Render() holds the frame before.
+ *
+ * Each step is drawn from the step number alone, so a step can be drawn
+ * late or skipped without the effect drifting, and sparkle repeats exactly
+ * each time it is run.
+ */
+
+#ifndef LedEffect_h
+#define LedEffect_h
+
+#include <string.h>
+#include "LedMatrix.h"
+
+#define LED_EFFECT_SCROLL  'S'
+#define LED_EFFECT_WIPE    'W'
+#define LED_EFFECT_CHASE   'C'
+#define LED_EFFECT_SPARKLE 'K'
+#define LED_EFFECT_FILL    'F'
+#define LED_EFFECT_BOUNCE  'B'
+#define LED_EFFECT_AUDIO   'A'
+#define LED_EFFECT_TRANSITION 'T'
+
+/*
+ * A parsed effect.  It has no constructor so that it can share space with
+ * a frame in a union.
+ */
+template <int Rows, int Cols>
+class LedEffectT {
+ public:
+  typedef LedFrameT<Rows, Cols> Frame;
+
+  // Read a description.  Returns false, and leaves the effect unchanged,
+  // if the text isn't one.
+  bool Parse(const char *text);
+
+  // Milliseconds each step is shown for
+  unsigned int StepMs() const { return step_ms_; }
+
+  // One of the LED_EFFECT_ letters
+  unsigned char Type() const { return type_; }
+
+  // Brightness, 0-15
+  unsigned char Level() const { return level_; }
+
+  // Draw step number step into frame.  Scroll moves the LEDs of source;
+  // the other effects ignore it.
+  void Render(unsigned int step, const Frame &source, Frame *frame) const;
+
+  // Draw step number step of steps of a transition from one frame to the
+  // next.  Steps past the last draw the last.
+  void Transition(unsigned int step, unsigned int steps, const Frame &from,
+                  const Frame &to, Frame *frame) const;
+
+ private:
+  static unsigned char GetLevel(const Frame &frame, int led);
+  static void SetLevel(Frame *frame, int led, unsigned char level);
+  unsigned char LineLength() const;
+  unsigned char LinePosition(int row, int col) const;
+
+  unsigned char type_;
+  unsigned char level_;
+  unsigned char option_;
+  unsigned int step_ms_;
+};
+
+// Effects for the ElectricPlunger's matrix
+typedef LedEffectT<LED_NUM_ROWS, LED_NUM_COLS> LedEffect;
+
+template <int Rows, int Cols>
+bool LedEffectT<Rows, Cols>::Parse(const char *text) {
+  if (!strchr("SWCKFBAT", text[0]) || text[0] == 0) {
+    return false;
+  }
+  unsigned int step_ms = 0;
+  for (int i = 1; i <= 4; ++i) {
+    if (text[i] < '0' || text[i] > '9') {
+      return false;
+    }
+    step_ms = step_ms * 10 + text[i] - '0';
+  }
+  if (step_ms == 0 || text[5] < '1' || text[5] > '9') {
+    return false;
+  }
+  if (text[0] == LED_EFFECT_SPARKLE
+      ? text[6] < '0' || text[6] > '9'
+      : text[0] == LED_EFFECT_TRANSITION
+      ? !strchr("HLX", text[6]) || text[6] == 0
+      : text[0] != LED_EFFECT_BOUNCE && text[0] != LED_EFFECT_AUDIO
+        && !strchr("UDLR", text[6])) {
+    return false;
+  }
+  type_ = text[0];
+  step_ms_ = step_ms;
+  level_ = LedMatrixBase::Level(text[5]);
+  option_ = text[6];
+  return true;
+}
+
+/*
+ * Rows move for 'U' and 'D', columns for 'L' and 'R'.
+ */
+template <int Rows, int Cols>
+unsigned char LedEffectT<Rows, Cols>::LineLength() const {
+  return option_ == 'U' || option_ == 'D' ? Rows : Cols;
+}
+
+/*
+ * Where an LED's row or column comes in the direction of the effect,
+ * from 0 at the edge it starts from.
+ */
+template <int Rows, int Cols>
+unsigned char LedEffectT<Rows, Cols>::LinePosition(int row, int col) const {
+  switch (option_) {
+  case 'D':
+    return row;
+  case 'U':
+    return Rows - 1 - row;
+  case 'R':
+    return col;
+  default:
+    return Cols - 1 - col;
+  }
+}
+
+template <int Rows, int Cols>
+unsigned char LedEffectT<Rows, Cols>::GetLevel(const Frame &frame, int led) {
+  unsigned char level = 0;
+  for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+    if (frame.planes[plane].bits[led >> 3] & (1 << (led & 7))) {
+      level |= 1 << plane;
+    }
+  }
+  return level;
+}
+
+template <int Rows, int Cols>
+void LedEffectT<Rows, Cols>::SetLevel(Frame *frame, int led,
+                                      unsigned char level) {
+  for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+    if (level & (1 << plane)) {
+      frame->planes[plane].bits[led >> 3] |= 1 << (led & 7);
+    }
+  }
+}
+
+template <int Rows, int Cols>
+void LedEffectT<Rows, Cols>::Render(unsigned int step, const Frame &source,
+                                    Frame *frame) const {
+  memset(frame, 0, sizeof(*frame));
+  unsigned char length = LineLength();
+
+  switch (type_) {
+  case LED_EFFECT_TRANSITION:
+    memcpy(frame, &source, sizeof(*frame));
+    break;
+
+  case LED_EFFECT_SCROLL: {
+    // Each LED takes the one offset lines behind it
+    unsigned char offset = step % length;
+    for (int row = 0; row < Rows; ++row) {
+      for (int col = 0; col < Cols; ++col) {
+        int from_row = row;
+        int from_col = col;
+        switch (option_) {
+        case 'D':
+          from_row = (row + Rows - offset) % Rows;
+          break;
+        case 'U':
+          from_row = (row + offset) % Rows;
+          break;
+        case 'R':
+          from_col = (col + Cols - offset) % Cols;
+          break;
+        default:
+          from_col = (col + offset) % Cols;
+        }
+        SetLevel(frame, row * Cols + col,
+                 GetLevel(source, from_row * Cols + from_col));
+      }
+    }
+    break;
+  }
+
+  case LED_EFFECT_WIPE: {
+    // Lines 0 to phase are lit, then lines up to phase - length are dark
+    unsigned char phase = step % (2 * length);
+    for (int led = 0; led < Rows * Cols; ++led) {
+      unsigned char position = LinePosition(led / Cols, led % Cols);
+      if (phase < length ? position <= phase : position > phase - length) {
+        SetLevel(frame, led, level_);
+      }
+    }
+    break;
+  }
+
+  case LED_EFFECT_CHASE: {
+    // The head at full brightness and two lines behind it at half and a
+    // quarter
+    unsigned char head = step % length;
+    for (int led = 0; led < Rows * Cols; ++led) {
+      unsigned char behind =
+          (head + length - LinePosition(led / Cols, led % Cols)) % length;
+      if (behind < 3) {
+        SetLevel(frame, led, level_ >> behind);
+      }
+    }
+    break;
+  }
+
+  case LED_EFFECT_SPARKLE: {
+    // A 16 bit xorshift seeded by the step number
+    uint16_t bits = step * 40503U + 1;
+    unsigned char density = option_ - '0';
+    for (int led = 0; led < Rows * Cols; ++led) {
+      bits ^= bits << 7;
+      bits ^= bits >> 9;
+      bits ^= bits << 8;
+      if ((bits >> 8) % 10 < density) {
+        SetLevel(frame, led, 1 + ((bits & 0xFF) * level_ >> 8));
+      }
+    }
+    break;
+  }
+
+  case LED_EFFECT_FILL: {
+    // Count is lit, from 0 to all of them
+    unsigned char count = step % (Rows * Cols + 1);
+    for (int led = 0; led < Rows * Cols; ++led) {
+      int row = led / Cols;
+      int col = led % Cols;
+      unsigned char position = LinePosition(row, col);
+      unsigned char order = length == Rows
+          ? position * Cols + col : position * Rows + row;
+      if (order < count) {
+        SetLevel(frame, led, level_);
+      }
+    }
+    break;
+  }
+
+  case LED_EFFECT_BOUNCE: {
+    // Back and forth along each edge, at one LED a step on both
+    unsigned int row = step % (2 * (Rows - 1));
+    unsigned int col = step % (2 * (Cols - 1));
+    if (row >= Rows) {
+      row = 2 * (Rows - 1) - row;
+    }
+    if (col >= Cols) {
+      col = 2 * (Cols - 1) - col;
+    }
+    SetLevel(frame, row * Cols + col, level_);
+    break;
+  }
+  }
+}
+
+template <int Rows, int Cols>
+void LedEffectT<Rows, Cols>::Transition(unsigned int step, unsigned int steps,
+                                        const Frame &from, const Frame &to,
+                                        Frame *frame) const {
+  if (option_ == 'H') {
+    memcpy(frame, &from, sizeof(*frame));
+    return;
+  }
+  memset(frame, 0, sizeof(*frame));
+  if (step > steps) {
+    step = steps;
+  }
+  if (steps == 0) {
+    steps = step = 1;
+  }
+  // Rounded to the nearest level
+  unsigned long half = steps / 2;
+  for (int led = 0; led < Rows * Cols; ++led) {
+    unsigned long out = (unsigned long)GetLevel(from, led) * (steps - step);
+    unsigned long in = (unsigned long)GetLevel(to, led) * step;
+    unsigned char level;
+    if (option_ == 'L') {
+      level = (out + in + half) / steps;
+    } else {
+      out = (out + half) / steps;
+      in = (in + half) / steps;
+      level = out > in ? out : in;
+    }
+    SetLevel(frame, led, level);
+  }
+}
+
+#endif  // LedEffect_h
@@ -8,7 +8,8 @@
  * License: Creative Commons Attribution 3.0
  *          See LICENSE file for more details
  *
- * This library drives a 10 x 6 LED matrix.  
+ * This library drives a 10 x 6 LED matrix, or any other size through 
+ * LedMatrixT (see OTHER SIZES below).
  *
  * EXAMPLE USAGE:
  *
@@ -27,20 +28,20 @@
  *   if (matrix.IsReady()) {
  *     elapsed = millis - action_time;
  *     if (elapsed < 250) {
- *       matrix.DisplayLeds("111111111111111111111111111111"
- *                          "111111111111111111111111111111");
+ *       matrix.DisplayLeds("999999999999999999999999999999"
+ *                          "999999999999999999999999999999");
  *     } else if (elapsed < 500) {
- *       matrix.DisplayLeds("111111111111111111111111000000"
- *                          "111111111111111111111111000000");
+ *       matrix.DisplayLeds("999999999999999999999999000000"
+ *                          "999999999999999999999999000000");
  *     } else if (elapsed < 750) {
- *       matrix.DisplayLeds("111111111111111111000000000000"
- *                          "111111111111111111000000000000");
+ *       matrix.DisplayLeds("999999999999999999000000000000"
+ *                          "999999999999999999000000000000");
  *     } else if (elapsed < 1000) {
- *       matrix.DisplayLeds("111111111111000000000000000000"
- *                          "111111111111000000000000000000");
+ *       matrix.DisplayLeds("999999999999000000000000000000"
+ *                          "999999999999000000000000000000");
  *     } else if (elapsed < 1250) {
- *       matrix.DisplayLeds("111111000000000000000000000000"
- *                          "111111000000000000000000000000");
+ *       matrix.DisplayLeds("999999000000000000000000000000"
+ *                          "999999000000000000000000000000");
  *     } else if (elapsed < 1500) {
  *       matrix.DisplayLeds("000000000000000000000000000000"
  *                          "000000000000000000000000000000");
@@ -88,12 +89,29 @@
  *
  * The software waits in the IDLE state until the LedMatrix::DisplayLeds()
  * method is called.  Then, the state machine cycles through displaying each
- * row with the shift register and leaving each row on for a 
- * LED_ROW_DISPLAY_CYCLE microseconds (or optionally displaying each 
- * row multiple times by setting LED_MAX_INTENSITY > 1).
+ * row with the shift register and leaving each row on for its share of
+ * LED_SCAN_US microseconds, 1ms for 10 rows, split into the bitplanes 
+ * described under GRAYSCALE below.  Each plane is shifted out by the call
+ * that ends the one before and timed from when that one was due to end, 
+ * so a late call shortens the next plane rather than the refresh rate.  
+ * Called every 100us or so, the scan keeps to LED_SCAN_US.
  *
- * Once all 10 rows are displayed, the state machine goes back to the IDLE 
- * state.
+ * Once all 10 rows are displayed, it starts over at the first row.
+ *
+ * Frames are double buffered.  DisplayLeds() fills the back buffer, and 
+ * the buffers are swapped just before the first row of the next scan, so 
+ * a new frame never cuts a scan short and every row gets the same time.
+ * IsReady() is true once the last frame is on show, and FramesPresented()
+ * counts the swaps for callers that would rather pace themselves by it.
+ *
+ * Frames can also be passed in packed, 8 bytes for an on/off LedBitmap or
+ * 32 for a 16 level LedFrame, rather than as 60 characters.  PackFrame() 
+ * and PackBitmap() convert the characters.  Seven bitmaps, or nearly two
+ * grayscale frames, fit in the RAM of one string, so a sketch can keep a
+ * queue of frames ready.  LedEffect.h draws frames for scrolls, chases, fades
+ * between keyframes and other animations from a few parameters, so they
+ * needn't be stored, and LedSpectrum.h draws bars of the audio from
+ * WaveHC's play buffer.
  * 
  *
  * PERFORMANCE:
@@ -104,6 +122,12 @@
  * processor speed.  The shift register is rated at 25MHz at 4.5V, which is
  * faster than the 20MHz max clock speed of the MPU.
  *
+ * On the board's own pins (see LED_DATA_PIN and friends in LedMatrix.h) a 
+ * row is shifted out with sbi/cbi instructions, roughly 15 cycles a bit 
+ * instead of three ~50 cycle digitalWrite() calls.  The hardware SPI port 
+ * isn't used: it belongs to the SD card, and the matrix is refreshed from
+ * the SD busy hooks in the middle of card transfers.
+ *
  * 
  * INTERRUPTS:
  * 
@@ -115,6 +139,73 @@
  * The method RunStateMachineFromInterrut() can be called from code that 
  * is in an interrupt to refresh the matrix.
  *
+ * Alternatively, LedMatrix::StartRefreshTimer() hands the refresh to the 
+ * Timer2 compare A interrupt, so rows keep their time however long loop()
+ * is busy.  The handler re-enables interrupts while it shifts, so it 
+ * delays the WaveHC sample interrupt by no more than a few cycles.  While
+ * interrupts are masked, RunStateMachineFromInterrupt() runs the ticks the
+ * timer has flagged, so calling it from SdReader busy hooks keeps the 
+ * refresh going.
+ *
+ *
+ * GRAYSCALE:
+ *
+ * The matrix shows 16 levels with binary code modulation.  DisplayLeds()
+ * maps the digits '0' to '9' to 4 bit levels and splits the frame into 4 
+ * bitplanes of column masks, one byte per row.  Each row is shown as its 4
+ * bitplanes lit for 1, 2, 4 and 8 fifteenths of the row's time.  That is
+ * 4 shift-outs per row, where PWM with the same levels would need 15.  
+ * Refreshed by the timer, the outputs are off while a plane is shifted 
+ * in, so each plane gets blank_ticks_ extra to make up for it.  
+ * RunStateMachine() can only time the planes as closely as it gets 
+ * called, so the low levels are only even when the timer is used.
+ *
+ * The digits are mapped to levels on a gamma curve, so equal steps in the
+ * digits look like roughly equal steps in brightness.
+ *
+ *
+ * BRIGHTNESS:
+ *
+ * SetBrightness() dims the whole matrix without extra refresh passes.  The
+ * output enable is on pin 6, which is OC0A, so timer 0 can drive it with 
+ * inverted fast PWM while the rows are lit.  Timer 0 keeps the mode and 
+ * prescaler init() gave it for millis(); only the compare output and 
+ * OCR0A are used.  The pin is taken back from the timer while each row is
+ * shifted in.  The PWM runs at about 1.2kHz at 20MHz, slower than the 
+ * shortest bitplanes, so at low brightness and low levels the two can beat
+ * and shimmer.  FadeBrightness() steps the brightness at the start of each
+ * scan, from the refresh itself.
+ *
+ *
+ * ROW SKIPPING:
+ *
+ * DisplayFrame() notes which rows have an LED lit, and the scan only 
+ * visits those, so a frame with 2 lit rows is refreshed over 4 times as 
+ * often as one with 10.  By default (LED_SKIP_EVEN) each visited row keeps
+ * its usual time but the planes are shrunk by the fraction of rows lit and
+ * the rest of the row's time is dark, so every LED is lit for the same 
+ * share of time whatever the frame.  The planes don't shrink below 
+ * LED_MIN_UNIT_TICKS, so in very sparse frames the dark time grows to make
+ * up for it and the rows are visited a little less often.  The padding 
+ * also allows for the part of each plane's blank_ticks_ that the outputs
+ * are on, from the time the last shift took, so a frame with one lit row
+ * comes out within about 5% of the brightness it has with all 10 lit.  
+ * Refreshed from RunStateMachine(), the planes can't be shorter than the
+ * time between calls, so LED_SKIP_EVEN scans every row instead.
+ *
+ *
+ * OTHER SIZES:
+ *
+ * LedMatrix is LedMatrixT<10, 6, 2>.  LedMatrixT<Rows, Cols, Chain> drives
+ * Rows x Cols LEDs on Chain daisy-chained 74HC595s, wired like the board
+ * above: row selects in the low bits, active low, and the columns above 
+ * them.  The frame buffers, row words and shift-out are in the template 
+ * in LedMatrix.h, so their sizes and loops are compile time constants.  
+ * Everything else is in LedMatrixBase here and reaches the rows through 
+ * the ShiftOutRow() virtual.  Each row gets LED_SCAN_US / Rows, so a 16x8
+ * matrix on 4 registers keeps the 100Hz scan: 13 tick planes, with 8 
+ * ticks of blanking for its 32 bit shift.
+ *
  */
 
 /* Enable for extra debug messages out the serial port, but don't expect the
@@ -122,11 +213,20 @@
  */
 #define DEBUG 0
 
+#include <string.h>
+#include <avr/interrupt.h>
 #include "LedMatrix.h"
 
-// Length of time a single row is displayed.
-#define LED_ROW_DISPLAY_CYCLE 500
-#define LED_MAX_INTENSITY 1
+// Time for one scan of the whole matrix, in milliseconds
+#define LED_SCAN_MS (LED_SCAN_US / 1000)
+
+// The shortest bitplane unit a padded scan uses
+#define LED_MIN_UNIT_TICKS 3
+
+// Ways OutputsOn() enables the outputs
+#define LED_OUTPUT_ON    0
+#define LED_OUTPUT_PWM   1
+#define LED_OUTPUT_DARK  2
 
 // Definition of state machine states
 #define LED_STATE_IDLE             0
@@ -134,18 +234,63 @@
 #define LED_STATE_COMPUTE_ROW      2
 #define LED_STATE_DISPLAY_ROW      3
 
-LedMatrix::LedMatrix(int data_pin, int clock_pin, int output_enable_pin) 
+/*
+ * Each row is shown for LED_SCAN_US / rows, and its bitplanes take 15 
+ * units of that.  Timer2 counts at F_CPU/64 (3.2us at 20MHz).  The 
+ * outputs are off for roughly 2 ticks per shift register while a plane is
+ * shifted in, so each plane gets that much extra.
+ */
+LedMatrixBase::LedMatrixBase(int data_pin, int clock_pin, 
+                             int output_enable_pin, unsigned char rows,
+                             unsigned char chain) 
   : led_data_pin_(data_pin),
     led_clock_pin_(clock_pin),
     led_output_enable_pin_(output_enable_pin),
+    front_(0),
+    fast_shift_(LED_FAST_SHIFT && data_pin == LED_DATA_PIN 
+                && clock_pin == LED_CLOCK_PIN
+                && output_enable_pin == LED_OE_PIN),
+    num_rows_(rows),
+    unit_us_(LED_SCAN_US / rows / 15),
+    unit_ticks_((F_CPU / 64 / 1000) * (LED_SCAN_US / rows) / 1000 / 15),
+    blank_ticks_(2 * chain),
     last_action_time_(0),
-    in_progress_(false) {
+    swap_pending_(false),
+    frames_presented_(0),
+    in_progress_(false),
+    timer_driven_(false),
+    row_skip_(LED_SKIP_EVEN),
+    scan_rows_(0),
+    scan_unit_ticks_(0),
+    scan_dark_ticks_(0),
+    dark_left_(0),
+    shift_ticks_(blank_ticks_),
+    pwm_capable_(output_enable_pin == LED_OE_PWM_PIN),
+    output_mode_(LED_OUTPUT_ON),
+    brightness_(0xFF00),
+    fade_step_(0),
+    fade_target_(255),
+    fade_scans_(0) {
+  lit_rows_[0] = lit_rows_[1] = 0;
   // Communicate to the 74HC595 over 3 pins
   pinMode(led_data_pin_, OUTPUT);
   pinMode(led_clock_pin_, OUTPUT);
   pinMode(led_output_enable_pin_, OUTPUT);
 }
 
+// 4 bit brightness of the digits '0' to '9', on a gamma curve
+static unsigned char led_levels[10] = {0, 1, 2, 3, 4, 6, 8, 10, 12, 15};
+
+unsigned char LedMatrixBase::Level(char value) {
+  if (value <= '0') {
+    return 0;
+  }
+  if (value >= '9') {
+    return 15;
+  }
+  return led_levels[value - '0'];
+}
+
 /*
  * Each of these state machine methods executes this state's action and 
  * return the next state.
@@ -153,49 +298,114 @@ LedMatrix::LedMatrix(int data_pin, int clock_pin, int output_enable_pin)
 
 /*
  * The IDLE state does nothing.  To get out of Idle state, someone
- * must put new data into the matrix using LedMatrix::DisplayLeds().
+ * must put the first frame into the matrix using LedMatrix::DisplayLeds().
  */
-int LedMatrix::LedStateIdle() {
+int LedMatrixBase::LedStateIdle() {
   return LED_STATE_IDLE;
 }
 
 /*
- * LedMatrix::DisplayLeds() puts the machine into this state.  This state
- * prepares the machine for going through the refresh cycle.
+ * LedMatrix::DisplayLeds() puts the machine into this state from IDLE.  
+ * This state prepares the machine for going through the refresh cycle.
  */
-int LedMatrix::LedStateNewData() {
-  current_row_ = 0;
+int LedMatrixBase::LedStateNewData() {
   current_value_ = 0;
+  StartFrame();
   last_action_time_ = micros();
   return LED_STATE_COMPUTE_ROW;
 }
 
 /*
- * Compute the binary value to shift out to the shift register for the
- * next row to display and shift it out.
+ * Called before the first row of each scan.  Puts the frame waiting in the
+ * back buffer on show, plans the scan's timing and moves to its first row.
  */
-int LedMatrix::LedStateComputeRow() {
-  unsigned long columns = 0;
-  for (int i = 0; i < LED_NUM_COLS; i++) {
-    columns = columns << 1;
-    int led_value = 
-        led_values_[current_row_][i];
-    if (led_value > '0' + current_value_) {
-      columns++;
+void LedMatrixBase::StartFrame() {
+  if (swap_pending_) {
+    front_ ^= 1;
+    swap_pending_ = false;
+    ++frames_presented_;
+  }
+  if (fade_scans_) {
+    if (--fade_scans_ == 0) {
+      brightness_ = (unsigned int)fade_target_ << 8;
+    } else {
+      brightness_ += fade_step_;
+    }
+    // The row about to be shifted in picks this up.
+    ApplyBrightness(brightness_ >> 8);
+  }
+
+  RowMask lit = lit_rows_[front_];
+  if (row_skip_ == LED_SKIP_OFF || lit == 0
+      || (row_skip_ == LED_SKIP_EVEN && !timer_driven_)) {
+    // Scan every row.  A dark frame still gets scanned so that swaps and
+    // fades keep their pace.  RunStateMachine() can't time planes shorter
+    // than the gap between calls, so it doesn't shrink them to skip rows
+    // evenly.
+    lit = ((unsigned long)1 << num_rows_) - 1;
+  }
+  scan_rows_ = lit;
+  unsigned char lit_count = 0;
+  for (; lit; lit >>= 1) {
+    lit_count += lit & 1;
+  }
+
+  scan_unit_ticks_ = unit_ticks_;
+  scan_dark_ticks_ = 0;
+  if (row_skip_ == LED_SKIP_EVEN && lit_count < num_rows_) {
+    // Shrink the planes in proportion to the rows being shown, and pad
+    // each row with dark time, so every LED keeps the share of time it
+    // had with all rows scanned.  The padding is worked out from the 
+    // planes as rounded, so planes held at LED_MIN_UNIT_TICKS get more.
+    // The outputs are only off for the shifts, not all of the blanking.
+    unsigned char ticks = unit_ticks_ * lit_count / num_rows_;
+    if (ticks < LED_MIN_UNIT_TICKS) {
+      ticks = LED_MIN_UNIT_TICKS;
     }
+    unsigned char shift = shift_ticks_ < blank_ticks_ 
+        ? shift_ticks_ : blank_ticks_;
+    unsigned int blank = LED_NUM_PLANES * blank_ticks_;
+    unsigned int row_lit = 15 * ticks + LED_NUM_PLANES * (blank_ticks_ - shift);
+    unsigned int full_lit = 15 * unit_ticks_ 
+        + LED_NUM_PLANES * (blank_ticks_ - shift);
+    unsigned long row_ticks = (unsigned long)row_lit * num_rows_
+        * (15 * unit_ticks_ + blank) / ((unsigned long)lit_count * full_lit);
+    unsigned int planes = 15 * ticks + blank;
+    scan_unit_ticks_ = ticks;
+    scan_dark_ticks_ = row_ticks > planes ? row_ticks - planes : 0;
+  }
+
+  current_row_ = 0;
+  while (!(scan_rows_ & 1U << current_row_)) {
+    ++current_row_;
   }
+}
 
-  // Send the column to the shift register
-  unsigned long int to_shift_register =
-        (~(1L << current_row_) & 0x03FF)
-        | (columns << LED_COLUMN_START_BIT);
+/*
+ * Move on to the next row of the scan, or start the next scan after the 
+ * last one.
+ */
+void LedMatrixBase::NextRow() {
+  do {
+    ++current_row_;
+  } while (current_row_ < num_rows_ && !(scan_rows_ & 1U << current_row_));
+  if (current_row_ >= num_rows_) {
+    StartFrame();
+  }
+}
 
+/*
+ * Shift out the next row to display.
+ */
+int LedMatrixBase::LedStateComputeRow() {
 #if DEBUG
-  Serial.print(" Calculated data: ");
-  Serial.println(to_shift_register, BIN);
+  Serial.print(" Row: ");
+  Serial.print(current_row_, DEC);
+  Serial.print(" plane: ");
+  Serial.println(current_value_, DEC);
   delay(1000);
 #endif
-  SendToShiftRegister(to_shift_register);
+  ShiftOutRow();
 
   // Remember the time this executed so we can compute elapsed time
   last_action_time_ = micros();
@@ -204,34 +414,41 @@ int LedMatrix::LedStateComputeRow() {
 }
 
 /*
- * Wait for the display cycle time to end.  While in this state, the LEDs 
- * for one row are on.  If LED_MAX_INTENSITY is > 1, th en each row will be
- * displayed multiple times, turning off any columns that have values less
- * than the current intensity.
+ * Wait for the current bitplane's display time to end.  While in this 
+ * state, the LEDs for one row are on.  Each row is displayed once for each
+ * bitplane.  The next plane is shifted out in the same call, and timed 
+ * from when this one should have ended, so a late call shortens the next
+ * plane instead of stretching the scan.
  */
-int LedMatrix::LedStateDisplayingRow() {
+int LedMatrixBase::LedStateDisplayingRow() {
+  unsigned long dwell = (unsigned long)unit_us_ << current_value_;
+  unsigned long late = micros() - last_action_time_;
   // Just wait around displaying the led
-  if ((micros() - last_action_time_) 
-          > LED_ROW_DISPLAY_CYCLE) {
-    if (++current_value_ > LED_MAX_INTENSITY) {
-      current_value_ = 0;
-      if (++current_row_ >= LED_NUM_ROWS) {
-        current_row_ = 0;
-        return LED_STATE_IDLE;
-      }
-    }
-    return LED_STATE_COMPUTE_ROW;
+  if (late < dwell) {
+    return LED_STATE_DISPLAY_ROW;
+  }
+  late -= dwell;
+  // After a stall longer than a row, start timing afresh.
+  if (late > 15 * (unsigned long)unit_us_) {
+    late = 0;
+  }
+  if (++current_value_ >= LED_NUM_PLANES) {
+    current_value_ = 0;
+    NextRow();
   }
+  ShiftOutRow();
+  last_action_time_ = micros() - late;
   return LED_STATE_DISPLAY_ROW;
 }
 
 /*
  * Drives the state machine.  Call this fuunction often!
  */
-void LedMatrix::RunStateMachine() {
+void LedMatrixBase::RunStateMachine() {
 
   noInterrupts();
-  if (in_progress_ || (micros() - last_action_time_) < 2) {
+  if (in_progress_ || timer_driven_ ||
+      (micros() - last_action_time_) < 2) {
     interrupts();
     return;
   }
@@ -247,12 +464,23 @@ void LedMatrix::RunStateMachine() {
 
 /*
  * This routine is like RunStateMachine, but assumes that the processor
- * is already interrupted or interrupts already masked.
+ * is already interrupted or interrupts already masked.  When the matrix is
+ * refreshed by Timer2 and interrupts are masked, the timer interrupt can't
+ * run here, so this does its work if a tick is due.  With interrupts
+ * enabled the timer interrupt does it, and polling the flag could step a
+ * plane twice if the interrupt came in between the test and the clear.
  */
-void LedMatrix::RunStateMachineFromInterrupt() {
+void LedMatrixBase::RunStateMachineFromInterrupt() {
   if (in_progress_) {
     return;
   }
+  if (timer_driven_) {
+    if (!(SREG & _BV(SREG_I)) && (TIFR2 & _BV(OCF2A))) {
+      TIFR2 = _BV(OCF2A);
+      RefreshFromTimer();
+    }
+    return;
+  }
   RunStateMachineImpl();  
 }
 
@@ -260,7 +488,7 @@ void LedMatrix::RunStateMachineFromInterrupt() {
  * Does the dirty work of calling the right state function and shifting to
  * the next state.
  */
-void LedMatrix::RunStateMachineImpl() {
+void LedMatrixBase::RunStateMachineImpl() {
   int next_state;
 
   switch(led_state_) {
@@ -285,42 +513,237 @@ void LedMatrix::RunStateMachineImpl() {
   }
 }
 
-bool LedMatrix::IsReady() {
-  return (led_state_ == LED_STATE_IDLE ? true : false);
+// The matrix refreshed by the Timer2 interrupt
+static LedMatrixBase *timer_matrix = 0;
+
+#if defined(__AVR_ATmega328P__)
+SIGNAL(TIMER2_COMPA_vect) {
+#else
+SIGNAL(SIG_OUTPUT_COMPARE2A) {
+#endif
+  // Let the audio interrupts in while the row is shifted out.  Our own
+  // interrupt stays off so it can't nest if a row runs long.
+  TIMSK2 &= ~_BV(OCIE2A);
+  sei();
+  timer_matrix->RefreshFromTimer();
+  cli();
+  if (timer_matrix) {
+    TIMSK2 |= _BV(OCIE2A);
+  }
+}
+
+void LedMatrixBase::StartRefreshTimer() {
+  noInterrupts();
+  timer_matrix = this;
+  timer_driven_ = true;
+  if (led_state_ != LED_STATE_IDLE) {
+    led_state_ = LED_STATE_NEW_DATA;
+  }
+  TCCR2A = _BV(WGM21);     // CTC mode, OC2A/OC2B pins not used
+  TCCR2B = _BV(CS22);      // clk/64
+  OCR2A = unit_ticks_ + blank_ticks_ - 1;
+  TCNT2 = 0;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 |= _BV(OCIE2A);
+  interrupts();
+}
+
+void LedMatrixBase::StopRefreshTimer() {
+  noInterrupts();
+  TIMSK2 &= ~_BV(OCIE2A);
+  TCCR2B = 0;
+  timer_matrix = 0;
+  timer_driven_ = false;
+  if (led_state_ != LED_STATE_IDLE) {
+    led_state_ = LED_STATE_NEW_DATA;
+  }
+  interrupts();
 }
 
-void LedMatrix::DisplayLeds(char* values) {
-  for (int i = 0; i < LED_NUM_ROWS; ++i) {
-    for (int j = 0; j < LED_NUM_COLS; ++j) {
-      led_values_[i][j] = *values;
-      values++;
+/*
+ * One Timer2 tick: shift out the next bitplane and set the timer for how
+ * long it stays lit.  Nothing is shown until DisplayLeds() is first called.
+ */
+void LedMatrixBase::RefreshFromTimer() {
+  // A busy hook called from an interrupt that came in while we were 
+  // shifting out a row.
+  if (in_progress_) {
+    return;
+  }
+  if (led_state_ == LED_STATE_IDLE) {
+    return;
+  }
+  in_progress_ = true;
+  // Time the next plane from the match that ended this one.  In CTC mode
+  // the counter clears on the tick after a match, but not if OCR2A has 
+  // changed by then, as it does below, so it is set here.  Cleared or 
+  // not, this leaves out the ticks the interrupt came in late.
+  unsigned char top = OCR2A;
+  unsigned char count = TCNT2;
+  TCNT2 = count >= top ? count - top : count + 1;
+  if (led_state_ == LED_STATE_NEW_DATA) {
+    current_value_ = 0;
+    dark_left_ = 0;
+    StartFrame();
+    led_state_ = LED_STATE_DISPLAY_ROW;
+  }
+  if (current_value_ == LED_NUM_PLANES) {
+    // The row's planes are done; keep it dark for the padding, up to 256
+    // ticks at a time.
+    if (!dark_left_) {
+      dark_left_ = scan_dark_ticks_;
+      OutputsOff();
+    }
+    unsigned int ticks = dark_left_ > 256 ? 256 : dark_left_;
+    OCR2A = ticks - 1;
+    dark_left_ -= ticks;
+    if (!dark_left_) {
+      current_value_ = 0;
+      NextRow();
+    }
+  } else {
+    OCR2A = (scan_unit_ticks_ << current_value_) + blank_ticks_ - 1;
+    unsigned char start = TCNT2;
+    ShiftOutRow();
+    shift_ticks_ = TCNT2 - start;
+    if (++current_value_ == LED_NUM_PLANES && !scan_dark_ticks_) {
+      current_value_ = 0;
+      NextRow();
     }
   }
-  led_state_ = LED_STATE_NEW_DATA;
+  // Polled from a busy hook, the match may be long past.  Don't let the
+  // counter run on through 255.
+  if (TCNT2 >= OCR2A) {
+    TCNT2 = 0;
+  }
+  in_progress_ = false;
+}
+
+void LedMatrixBase::SetRowSkip(unsigned char mode) {
+  row_skip_ = mode;
+}
+
+bool LedMatrixBase::IsReady() {
+  return !swap_pending_;
+}
+
+unsigned int LedMatrixBase::FramesPresented() {
+  noInterrupts();
+  unsigned int frames = frames_presented_;
+  interrupts();
+  return frames;
 }
 
 /*
- * Writes a 16 bit value to the pair of 74HC595 shift registers. 
- * The outputs are turned off while the valuse is being shifted in.
+ * Take back a frame that hasn't been shown yet, so the refresh can't 
+ * swap the back buffer in while it is being written.  Returns the index
+ * of the back buffer.
  */
-void LedMatrix::SendToShiftRegister(unsigned long value) {
-  // turn off all outputs
-  digitalWrite(led_output_enable_pin_, HIGH);
+unsigned char LedMatrixBase::TakeBackBuffer() {
+  noInterrupts();
+  swap_pending_ = false;
+  interrupts();
+  return front_ ^ 1;
+}
 
-  // shift the data out msbit first
-  for (long index = 15; index >= 0; --index) {
-    digitalWrite(led_clock_pin_, LOW);
-    char bit = ((value & (1 << index)) > 0) ? HIGH : LOW;
-    digitalWrite(led_data_pin_, bit);
-    digitalWrite(led_clock_pin_, HIGH);
+/*
+ * Have the back buffer swapped in at the start of the next scan.
+ */
+void LedMatrixBase::PresentBackBuffer() {
+  noInterrupts();
+  swap_pending_ = true;
+  if (led_state_ == LED_STATE_IDLE) {
+    led_state_ = LED_STATE_NEW_DATA;
   }
+  interrupts();
+}
 
-  // Toggle the clock low & high once more to push the last bit to 
-  // the register.
-  digitalWrite(led_clock_pin_, LOW);
-  digitalWrite(led_clock_pin_, HIGH);
+/*
+ * Set how the outputs are enabled for a brightness.  Timer 0's compare 
+ * output is only connected by OutputsOn().
+ */
+void LedMatrixBase::ApplyBrightness(unsigned char brightness) {
+  // Gamma 2: duty = brightness^2 / 255
+  unsigned char duty = ((unsigned int)brightness * brightness + 254) / 255;
+  if (duty == 0) {
+    output_mode_ = LED_OUTPUT_DARK;
+  } else if (duty == 255 || !pwm_capable_) {
+    output_mode_ = LED_OUTPUT_ON;
+  } else {
+    // In inverted mode the pin is low, enabling the outputs, for 
+    // OCR0A + 1 counts of 256.
+    OCR0A = duty;
+    output_mode_ = LED_OUTPUT_PWM;
+  }
+}
+
+void LedMatrixBase::SetBrightness(unsigned char brightness) {
+  noInterrupts();
+  fade_scans_ = 0;
+  brightness_ = (unsigned int)brightness << 8;
+  ApplyBrightness(brightness);
+  // Change the row on show now rather than at the next shift.
+  if (led_state_ != LED_STATE_IDLE && !in_progress_) {
+    OutputsOff();
+    OutputsOn();
+  }
+  interrupts();
+}
 
-  // Turn the outputs back on
-  digitalWrite(led_output_enable_pin_, LOW);
+unsigned char LedMatrixBase::Brightness() {
+  noInterrupts();
+  unsigned char brightness = brightness_ >> 8;
+  interrupts();
+  return brightness;
+}
+
+void LedMatrixBase::FadeBrightness(unsigned char brightness, 
+                               unsigned int duration_ms) {
+  unsigned int scans = duration_ms / LED_SCAN_MS;
+  if (scans == 0) {
+    SetBrightness(brightness);
+    return;
+  }
+  noInterrupts();
+  fade_target_ = brightness;
+  // Only used for fades of 2 scans or more, so it fits in an int.
+  fade_step_ = (((long)brightness << 8) - (long)brightness_) / (long)scans;
+  fade_scans_ = scans;
+  interrupts();
 }
 
+/*
+ * Turn off all outputs, taking the pin back from timer 0 if it has it.
+ */
+void LedMatrixBase::OutputsOff() {
+  if (pwm_capable_) {
+    TCCR0A &= ~(_BV(COM0A1) | _BV(COM0A0));
+  }
+  if (fast_shift_) {
+    led_outputs_off();
+  } else {
+    digitalWrite(led_output_enable_pin_, HIGH);
+  }
+}
+
+/*
+ * Turn the outputs back on at the current brightness.
+ */
+void LedMatrixBase::OutputsOn() {
+  switch (output_mode_) {
+  case LED_OUTPUT_ON:
+    if (fast_shift_) {
+      led_outputs_on();
+    } else {
+      digitalWrite(led_output_enable_pin_, LOW);
+    }
+    break;
+  case LED_OUTPUT_PWM:
+    // Inverted fast PWM: clear at BOTTOM, set at the compare match
+    TCCR0A |= _BV(COM0A1) | _BV(COM0A0);
+    break;
+  default:
+    // Dark: leave them off
+    break;
+  }
+}
@@ -14,58 +14,425 @@
 #define LedMatrix_h
 
 #include "WProgram.h"
+#include <string.h>
 
+// The ElectricPlunger's matrix.  LedMatrixT below takes any other size.
 #define LED_NUM_ROWS 10
 #define LED_NUM_COLS 6
-#define LED_COLUMN_START_BIT 10
+#define LED_NUM_PLANES 4
 
-class LedMatrix {
- public:
-  LedMatrix(int dataPin, int clockPin, int outputEnablePin);
+// Time for one scan of the whole matrix, in microseconds.  Each row gets
+// an equal share, so a taller matrix keeps the same refresh rate.
+#define LED_SCAN_US 10000
 
-  // Populate the 10x6 led matrix.  Each character is a value from '0' to '9' 
-  // where '0' is off, and '9' is the brightest setting.  Populate the matrix
-  // with a 60 character long string one row at a time.
-  void DisplayLeds(char *values);
+// The shift register pins on the ElectricPlunger board.  A matrix built on
+// these pins writes the port registers directly, which is many times faster
+// than digitalWrite().  A matrix on any other pins, or any matrix when
+// LED_FAST_SHIFT is 0, uses digitalWrite().
+#ifndef LED_FAST_SHIFT
+#define LED_FAST_SHIFT 1
+#endif
+
+#define LED_DATA_PIN 7
+#define LED_DATA_PORT PORTD
+#define LED_DATA_BIT PIND7
+
+#define LED_CLOCK_PIN 8
+#define LED_CLOCK_PORT PORTB
+#define LED_CLOCK_BIT PINB0
+
+#define LED_OE_PIN 6
+#define LED_OE_PORT PORTD
+#define LED_OE_BIT PIND6
+
+// The output enable pin that timer 0 can drive with PWM (OC0A)
+#define LED_OE_PWM_PIN 6
+
+// What the scan does with rows that have no LEDs lit, see SetRowSkip()
+#define LED_SKIP_OFF 0
+#define LED_SKIP_EVEN 1
+#define LED_SKIP_FAST 2
+
+// Single instruction (sbi/cbi) pin changes for the fast shift-out path.
+// Being atomic, they can't undo a change the WaveHC interrupt makes to
+// another PORTD pin the way digitalWrite() can.
+#define led_data_high() LED_DATA_PORT |= _BV(LED_DATA_BIT)
+#define led_data_low() LED_DATA_PORT &= ~_BV(LED_DATA_BIT)
+#define led_clock_high() LED_CLOCK_PORT |= _BV(LED_CLOCK_BIT)
+#define led_clock_low() LED_CLOCK_PORT &= ~_BV(LED_CLOCK_BIT)
+#define led_outputs_off() LED_OE_PORT |= _BV(LED_OE_BIT)
+#define led_outputs_on() LED_OE_PORT &= ~_BV(LED_OE_BIT)
+
+// A packed frame.  Each bitmap holds one bit for each LED, row by row:
+// LED n = row * Cols + col is bit n % 8 of byte n / 8.  An on/off frame
+// is one bitmap; a grayscale frame has a bitmap for each bit of
+// brightness, least significant first.
+template <int Rows, int Cols>
+struct LedBitmapT {
+  unsigned char bits[(Rows * Cols + 7) / 8];
+};
 
-  // Returns true if the matrix is ready to display new data.
+template <int Rows, int Cols>
+struct LedFrameT {
+  LedBitmapT<Rows, Cols> planes[LED_NUM_PLANES];
+};
+
+// The smallest type that holds a row's bits for a chain of shift registers
+template <int Chain> struct LedShiftWord { typedef unsigned long Type; };
+template <> struct LedShiftWord<1> { typedef unsigned char Type; };
+template <> struct LedShiftWord<2> { typedef unsigned int Type; };
+
+/*
+ * Everything that doesn't depend on the size of the matrix: the refresh
+ * state machine, the Timer2 refresh, double buffering and brightness.
+ * Use it through LedMatrixT or LedMatrix below.
+ */
+class LedMatrixBase {
+ public:
+  // Returns true if the matrix is ready to display new data: the last
+  // frame passed to DisplayLeds() is on show.  A frame passed in before
+  // then replaces the one still waiting.
   bool IsReady();
 
-  // Call this function as often as possible. 
+  // The number of frames passed to DisplayLeds() that have been put on
+  // show.  Frames are only swapped in between scans of the whole matrix.
+  unsigned int FramesPresented();
+
+  // Dim the whole matrix, from 0 (off) to 255 (full), on a gamma curve.
+  // Below full, timer 0 drives the output enable with PWM, which costs no
+  // CPU.  This needs the output enable on LED_OE_PWM_PIN; on any other pin
+  // every brightness but 0 is full.  Call it after init() has started
+  // timer 0, from setup() or later, not from a constructor.
+  void SetBrightness(unsigned char brightness);
+  unsigned char Brightness();
+  // Change the brightness gradually, a step at the start of each scan.
+  void FadeBrightness(unsigned char brightness, unsigned int duration_ms);
+
+  // Rows with no LEDs lit are left out of the scan, so the lit rows are 
+  // refreshed more often.  LED_SKIP_EVEN, the default, shortens the lit 
+  // rows' time to match, so brightness doesn't depend on how many rows are
+  // lit; without the refresh timer it scans every row.  LED_SKIP_FAST 
+  // keeps their time, so sparse frames are brighter.  LED_SKIP_OFF scans 
+  // every row.  Takes effect at the next scan.
+  void SetRowSkip(unsigned char mode);
+
+  // Call this function as often as possible.
   void RunStateMachine();
   // If you are already in an interrupt, you can use this function.
   void RunStateMachineFromInterrupt();
 
+  // Refresh the matrix from the Timer2 compare A interrupt instead of from
+  // RunStateMachine().  This also shows the LEDs in 16 levels of
+  // brightness instead of on and off.  Timer2 can't be used for
+  // anything else while this runs: no tone(), no analogWrite() on pins
+  // 3 and 11, and no WaveHC PWM audio.  Only one matrix can use the timer.
+  void StartRefreshTimer();
+  // Go back to refreshing from RunStateMachine().
+  void StopRefreshTimer();
+  // Called by the Timer2 interrupt handler.
+  void RefreshFromTimer();
+
+  // The 4 bit brightness of a digit '0' to '9', on a gamma curve.
+  static unsigned char Level(char value);
+
+ protected:
+  LedMatrixBase(int data_pin, int clock_pin, int output_enable_pin,
+                unsigned char rows, unsigned char chain);
+
+  // Shift out bitplane current_value_ of row current_row_ of the front
+  // buffer.
+  virtual void ShiftOutRow() = 0;
+
+  unsigned char TakeBackBuffer();
+  void PresentBackBuffer();
+  void OutputsOff();
+  void OutputsOn();
+
+  // Pins to communicate with the shift register
+  int led_data_pin_;
+  int led_clock_pin_;
+  int led_output_enable_pin_;
+
+  // Index of the buffer on show
+  volatile unsigned char front_;
+
+  // Bit n set for each row n with an LED lit, for each buffer
+  typedef unsigned int RowMask;
+  RowMask lit_rows_[2];
+
+  // Current row being displayed
+  int current_row_;
+
+  // Current bitplane being displayed
+  int current_value_;
+
+  // True when the pins match LED_DATA_PIN, LED_CLOCK_PIN and LED_OE_PIN.
+  bool fast_shift_;
+
  private:
   void RunStateMachineImpl();
   int LedStateNewData();
   int LedStateDisplayingRow();
   int LedStateIdle();
   int LedStateComputeRow();
-  void SendToShiftRegister(unsigned long value);
+  void StartFrame();
+  void NextRow();
+  void ApplyBrightness(unsigned char brightness);
 
-  // Pins to communicate with the shift register
-  int led_data_pin_;
-  int led_clock_pin_;
-  int led_output_enable_pin_;
+  // Geometry and the bitplane timing that follows from it
+  unsigned char num_rows_;
+  unsigned char unit_us_;
+  unsigned char unit_ticks_;
+  unsigned char blank_ticks_;
 
   // Current state in the state machine
-  char led_state_;
+  volatile char led_state_;
 
   // Indicates the last time a row was turned on.
   unsigned long last_action_time_;
 
-  // Each LED can have intensity 0-9, sorted as ascii chars
-  char led_values_[LED_NUM_ROWS][LED_NUM_COLS]; 
+  // True when the back buffer holds a frame to show at the next scan.
+  volatile bool swap_pending_;
 
-  // Current row being displayed
-  int current_row_;
-
-  // Current intensity value being displayed
-  int current_value_;
+  volatile unsigned int frames_presented_;
 
   // Provides protection against re-entrancy from interrupts.
   bool in_progress_;
+
+  // True when rows are advanced by the Timer2 interrupt.
+  volatile bool timer_driven_;
+
+  // LED_SKIP_OFF, LED_SKIP_EVEN or LED_SKIP_FAST
+  unsigned char row_skip_;
+
+  // The rows in this scan and how long their planes and padding last
+  RowMask scan_rows_;
+  unsigned char scan_unit_ticks_;
+  unsigned int scan_dark_ticks_;
+  // Padding still to come for the current row
+  unsigned int dark_left_;
+  // Timer ticks the last shift-out took, with the outputs off
+  unsigned char shift_ticks_;
+
+  // True when the output enable is on LED_OE_PWM_PIN.
+  bool pwm_capable_;
+
+  // How OutputsOn() enables the outputs: fully, with PWM, or not at all.
+  volatile unsigned char output_mode_;
+
+  // Brightness in 8.8 fixed point, and the fade in progress
+  volatile unsigned int brightness_;
+  int fade_step_;
+  unsigned char fade_target_;
+  volatile unsigned int fade_scans_;
 };
 
+/*
+ * A matrix of Rows x Cols LEDs driven through Chain daisy-chained 74HC595
+ * shift registers.  Bits 0 to Rows - 1 of the chain select the row, active
+ * low, and the Cols bits above them are the columns.  The sizes are
+ * template arguments, so the loops, masks and shift-out width are fixed at
+ * compile time.  Rows + Cols must fit in the chain and Cols in a byte.
+ */
+template <int Rows, int Cols, int Chain>
+class LedMatrixT : public LedMatrixBase {
+ public:
+  typedef LedBitmapT<Rows, Cols> Bitmap;
+  typedef LedFrameT<Rows, Cols> Frame;
+
+  LedMatrixT(int data_pin, int clock_pin, int output_enable_pin)
+    : LedMatrixBase(data_pin, clock_pin, output_enable_pin, Rows, Chain) {
+  }
+
+  // Populate the led matrix.  Each character is a value from '0' to '9'
+  // where '0' is off, and '9' is the brightest setting.  Populate the matrix
+  // with a Rows * Cols character long string one row at a time.
+  void DisplayLeds(char *values);
+  // Populate the matrix from a packed frame, with 16 levels of brightness.
+  void DisplayFrame(const Frame &frame);
+  // Populate the matrix from a bitmap.  Lit LEDs are at full brightness.
+  void DisplayBitmap(const Bitmap &bitmap);
+
+  // Convert the strings taken by DisplayLeds() to packed frames.  For a
+  // bitmap, any digit but '0' is on.
+  static void PackFrame(const char *values, Frame *frame);
+  static void PackBitmap(const char *values, Bitmap *bitmap);
+
+ protected:
+  virtual void ShiftOutRow();
+
+ private:
+  typedef typename LedShiftWord<Chain>::Type Word;
+
+  // Compile time checks of the geometry.  A negative array size fails.
+  typedef char ChainLength[Chain >= 1 && Chain <= 4 ? 1 : -1];
+  typedef char RowFitsChain[Rows + Cols <= 8 * Chain ? 1 : -1];
+  typedef char ColumnsFitByte[Cols <= 8 ? 1 : -1];
+  typedef char RowsFitMask[Rows <= 8 * sizeof(RowMask) ? 1 : -1];
+  // The longest bitplane must fit in Timer2's 8 bits (see LedMatrix.cpp).
+  typedef char PlaneFitsTimer[
+      (((F_CPU / 64 / 1000) * (LED_SCAN_US / Rows) / 1000 / 15)
+       << (LED_NUM_PLANES - 1)) + 2 * Chain <= 256 ? 1 : -1];
+
+  Word RowWord();
+  void SendToShiftRegister(Word value);
+
+  // Front and back buffers of the column masks of each row, one array per
+  // bit of brightness, least significant first.
+  unsigned char planes_[2][LED_NUM_PLANES][Rows];
+};
+
+// The ElectricPlunger's 10x6 matrix on two shift registers
+typedef LedMatrixT<LED_NUM_ROWS, LED_NUM_COLS, 2> LedMatrix;
+typedef LedMatrix::Bitmap LedBitmap;
+typedef LedMatrix::Frame LedFrame;
+
+/*
+ * The value to shift out to the shift register for the current row and
+ * bitplane.
+ */
+template <int Rows, int Cols, int Chain>
+typename LedMatrixT<Rows, Cols, Chain>::Word
+LedMatrixT<Rows, Cols, Chain>::RowWord() {
+  return (~((Word)1 << current_row_) & (((Word)1 << Rows) - 1))
+      | ((Word)planes_[front_][current_value_][current_row_] << Rows);
+}
+
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::ShiftOutRow() {
+  SendToShiftRegister(RowWord());
+}
+
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::DisplayLeds(char* values) {
+  Frame frame;
+  PackFrame(values, &frame);
+  DisplayFrame(frame);
+}
+
+/*
+ * Split the frame into column masks in the back buffer now so that the
+ * refresh only has to shift them out.
+ */
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::DisplayFrame(const Frame &frame) {
+  unsigned char back = TakeBackBuffer();
+  unsigned char row_or[Rows] = {0};
+  for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+    const unsigned char *bits = frame.planes[plane].bits;
+    int led = 0;
+    for (int i = 0; i < Rows; ++i) {
+      unsigned char columns = 0;
+      for (int j = 0; j < Cols; ++j, ++led) {
+        columns = (columns << 1) | ((bits[led >> 3] >> (led & 7)) & 1);
+      }
+      planes_[back][plane][i] = columns;
+      row_or[i] |= columns;
+    }
+  }
+  RowMask lit = 0;
+  for (int i = 0; i < Rows; ++i) {
+    if (row_or[i]) {
+      lit |= 1U << i;
+    }
+  }
+  lit_rows_[back] = lit;
+  PresentBackBuffer();
+}
+
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::DisplayBitmap(const Bitmap &bitmap) {
+  unsigned char back = TakeBackBuffer();
+  RowMask lit = 0;
+  int led = 0;
+  for (int i = 0; i < Rows; ++i) {
+    unsigned char columns = 0;
+    for (int j = 0; j < Cols; ++j, ++led) {
+      columns = (columns << 1) | ((bitmap.bits[led >> 3] >> (led & 7)) & 1);
+    }
+    for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+      planes_[back][plane][i] = columns;
+    }
+    if (columns) {
+      lit |= 1U << i;
+    }
+  }
+  lit_rows_[back] = lit;
+  PresentBackBuffer();
+}
+
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::PackFrame(const char *values,
+                                              Frame *frame) {
+  memset(frame, 0, sizeof(*frame));
+  for (int led = 0; led < Rows * Cols; ++led) {
+    unsigned char level = Level(values[led]);
+    for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+      if (level & (1 << plane)) {
+        frame->planes[plane].bits[led >> 3] |= 1 << (led & 7);
+      }
+    }
+  }
+}
+
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::PackBitmap(const char *values,
+                                               Bitmap *bitmap) {
+  memset(bitmap, 0, sizeof(*bitmap));
+  for (int led = 0; led < Rows * Cols; ++led) {
+    if (Level(values[led])) {
+      bitmap->bits[led >> 3] |= 1 << (led & 7);
+    }
+  }
+}
+
+/*
+ * Writes a value to the chain of 74HC595 shift registers.
+ * The outputs are turned off while the valuse is being shifted in.
+ */
+template <int Rows, int Cols, int Chain>
+void LedMatrixT<Rows, Cols, Chain>::SendToShiftRegister(Word value) {
+  const Word msbit = (Word)1 << (8 * Chain - 1);
+#if LED_FAST_SHIFT
+  if (fast_shift_) {
+    Word bits = value;
+    OutputsOff();
+    // Same sequence as below: msbit first, then one more clock.
+    for (unsigned char index = 0; index < 8 * Chain; ++index) {
+      led_clock_low();
+      if (bits & msbit) {
+        led_data_high();
+      } else {
+        led_data_low();
+      }
+      led_clock_high();
+      bits <<= 1;
+    }
+    led_clock_low();
+    led_clock_high();
+    OutputsOn();
+    return;
+  }
+#endif  // LED_FAST_SHIFT
+
+  // turn off all outputs
+  OutputsOff();
+
+  // shift the data out msbit first
+  for (unsigned char index = 0; index < 8 * Chain; ++index) {
+    digitalWrite(led_clock_pin_, LOW);
+    digitalWrite(led_data_pin_, (value & msbit) ? HIGH : LOW);
+    digitalWrite(led_clock_pin_, HIGH);
+    value <<= 1;
+  }
+
+  // Toggle the clock low & high once more to push the last bit to
+  // the register.
+  digitalWrite(led_clock_pin_, LOW);
+  digitalWrite(led_clock_pin_, HIGH);
+
+  // Turn the outputs back on
+  OutputsOn();
+}
+
 #endif  // LedMatrix_h
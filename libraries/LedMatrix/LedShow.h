@@ -0,0 +1,244 @@
+/*
+ * LedShow.h
+ *
+ * The layout of a .LEB file, a .led file compiled by host_tools/mkleb so
+ * that the sketch can load frames as they will be shown instead of
+ * parsing text.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * The file starts with an 8 byte header:
+ *
+ *   0  "LEDB"
+ *   4  LED_SHOW_VERSION
+ *   5  rows
+ *   6  columns
+ *   7  zero
+ *
+ * Then come the records, in the order they are shown.  Each is a kind
+ * byte, the time to show it in milliseconds as a varint, 7 bits a byte
+ * with the least significant first and the top bit set in all but the
+ * last byte, and then the data for the kind:
+ *
+ *   LED_SHOW_FRAME   32 bytes, a LedFrame as PackFrame() makes it
+ *   LED_SHOW_BITMAP  a level 0-15 and 8 bytes of LedBitmap, the lit LEDs
+ *                    all at that level
+ *   LED_SHOW_EFFECT  the 7 characters of an effect line, see LedEffect.h
+ *   LED_SHOW_DELTA   the frame before with some LEDs changed.  A count
+ *                    of 1 to LED_SHOW_MAX_DELTA comes between the kind
+ *                    and the duration.  The data is that many LED
+ *                    numbers, then their new levels, 4 bits each, low
+ *                    nibble first.  It only follows a frame, bitmap or
+ *                    delta record.
+ *
+ * A LED_SHOW_LOOP record has no duration.  It is the kind, a count of
+ * plays and a length in bytes, up to LED_SHOW_LOOP_SIZE.  The records in
+ * that many bytes after it are shown the given number of times, read from
+ * the card once and then replayed from the sketch's read-ahead buffer.
+ * They start with a record that isn't a delta and don't include padding
+ * or other loops.  The loop record and its records are in one block.
+ *
+ * A record never crosses a multiple of LED_SHOW_SECTOR bytes from the
+ * start of the file, so each one is in a single block of the card.
+ * Where the next record doesn't fit, the rest of the block is
+ * LED_SHOW_PAD bytes.  A grayscale frame takes 34 to 36 bytes, so 14 fit
+ * in a block, against 7 lines of a .led file; an on/off frame takes 11 or
+ * 12 bytes.  Version 1 files have no delta or loop records.
+ *
+ * A show can also travel inside a .wav file, made by host_tools/mkshow,
+ * so the sketch reads one file in order instead of two.  Its "leds"
+ * chunks, put together, are a .LEB file without the block padding.  The
+ * first comes before any audio, and each of the others just ahead of the
+ * audio in which the record before its first one starts, so the sketch
+ * has each record before it is due.  A chunk holds whole records,
+ * loops with their records, and at most LED_SHOW_CHUNK_SIZE bytes of them
+ * after the header, with a LED_SHOW_PAD byte to make the length even, as
+ * WaveHC doesn't skip RIFF's pad byte.  WaveHC hands each to the sketch
+ * as the refill reaches it.  The audio of each data chunk starts a
+ * multiple of 256 bytes into the file, with a "JUNK" chunk before it to
+ * fill the gap, and all but the last hold a multiple of 256 bytes, so
+ * every refill is one whole read from a block.
+ */
+
+#ifndef LedShow_h
+#define LedShow_h
+
+#include <string.h>
+#include "LedMatrix.h"
+#include "LedEffect.h"
+
+#define LED_SHOW_MAGIC "LEDB"
+#define LED_SHOW_VERSION 2
+#define LED_SHOW_HEADER_SIZE 8
+#define LED_SHOW_SECTOR 512
+
+// Record kinds
+#define LED_SHOW_PAD    0
+#define LED_SHOW_FRAME  1
+#define LED_SHOW_BITMAP 2
+#define LED_SHOW_EFFECT 3
+#define LED_SHOW_DELTA  4
+#define LED_SHOW_LOOP   5
+
+// Durations take at most this many bytes, up to 2^21 - 1 ms
+#define LED_SHOW_MAX_VARINT 3
+
+// Data bytes after the duration
+#define LED_SHOW_FRAME_SIZE 32
+#define LED_SHOW_BITMAP_SIZE 9
+#define LED_SHOW_EFFECT_SIZE 7
+
+// A delta changes at most this many LEDs, so that it's no longer than a
+// frame
+#define LED_SHOW_MAX_DELTA 20
+
+// The longest record, and the bytes of one that give its size
+#define LED_SHOW_MAX_RECORD 36
+#define LED_SHOW_HEAD_SIZE (2 + LED_SHOW_MAX_VARINT)
+
+// The most bytes of records a loop can hold
+#define LED_SHOW_LOOP_SIZE 80
+
+// The RIFF chunk of a show in a .wav file, and the most bytes of records
+// in one
+#define LED_SHOW_CHUNK_ID "leds"
+#define LED_SHOW_CHUNK_SIZE 128
+
+/*
+ * The size of the record that starts with the n bytes at head, which
+ * must include the duration, or 0 if it isn't a valid record.  For a
+ * loop this is the size of the loop record alone.
+ */
+static inline unsigned char LedShowRecordSize(const unsigned char *head,
+                                              unsigned char n) {
+  unsigned char i = 1;
+  unsigned char count = 0;
+  if (n < 1) {
+    return 0;
+  }
+  switch (head[0]) {
+  case LED_SHOW_LOOP:
+    return n >= 3 && head[1] && head[2] && head[2] <= LED_SHOW_LOOP_SIZE
+        ? 3 : 0;
+  case LED_SHOW_DELTA:
+    if (n < 2 || !head[1] || head[1] > LED_SHOW_MAX_DELTA) {
+      return 0;
+    }
+    count = head[1];
+    i = 2;
+    break;
+  case LED_SHOW_FRAME:
+  case LED_SHOW_BITMAP:
+  case LED_SHOW_EFFECT:
+    break;
+  default:
+    return 0;
+  }
+  for (unsigned char bytes = 1; ; ++bytes, ++i) {
+    if (i >= n || bytes > LED_SHOW_MAX_VARINT) {
+      return 0;
+    }
+    if (!(head[i] & 0x80)) {
+      break;
+    }
+  }
+  ++i;
+  switch (head[0]) {
+  case LED_SHOW_FRAME:
+    return i + LED_SHOW_FRAME_SIZE;
+  case LED_SHOW_BITMAP:
+    return i + LED_SHOW_BITMAP_SIZE;
+  case LED_SHOW_EFFECT:
+    return i + LED_SHOW_EFFECT_SIZE;
+  default:
+    return i + count + (count + 1) / 2;
+  }
+}
+
+// A line or record: a frame, or an effect that draws frames for its
+// duration (see LedEffect.h) in place of the LED data.
+struct LedShowEntry {
+  union {
+    LedFrame frame;
+    LedEffect effect;
+  };
+  unsigned long duration;  // milliseconds
+  bool is_effect;
+};
+
+// A frame record is copied straight into the entry
+typedef char LedShowFrameSizeCheck[
+    sizeof(LedFrame) == LED_SHOW_FRAME_SIZE ? 1 : -1];
+
+/*
+ * Decode the record at record, whose size LedShowRecordSize() has
+ * checked, into entry.  previous is the entry decoded before it, which a
+ * delta changes.  Returns false if it can't be shown.  Loop records are
+ * left to the reader, which decodes the records in them.
+ */
+static inline bool LedShowDecode(const unsigned char *record,
+                                 const LedShowEntry *previous,
+                                 LedShowEntry *entry) {
+  unsigned char kind = record[0];
+  unsigned char i = kind == LED_SHOW_DELTA ? 2 : 1;
+  unsigned long duration = 0;
+  for (unsigned char shift = 0; ; shift += 7) {
+    duration |= (unsigned long)(record[i] & 0x7F) << shift;
+    if (!(record[i++] & 0x80)) {
+      break;
+    }
+  }
+  const unsigned char *data = record + i;
+
+  entry->duration = duration;
+  entry->is_effect = false;
+  switch (kind) {
+  case LED_SHOW_FRAME:
+    memcpy(&entry->frame, data, LED_SHOW_FRAME_SIZE);
+    break;
+  case LED_SHOW_BITMAP:
+    // The lit LEDs in each plane of the level
+    memset(&entry->frame, 0, sizeof(entry->frame));
+    for (unsigned char plane = 0; plane < LED_NUM_PLANES; plane++) {
+      if (data[0] & (1 << plane)) {
+        memcpy(entry->frame.planes[plane].bits, data + 1,
+               LED_SHOW_BITMAP_SIZE - 1);
+      }
+    }
+    break;
+  case LED_SHOW_EFFECT:
+    entry->is_effect = entry->effect.Parse((const char*)data);
+    return entry->is_effect;
+  case LED_SHOW_DELTA: {
+    if (previous->is_effect) {
+      return false;
+    }
+    entry->frame = previous->frame;
+    unsigned char count = record[1];
+    for (unsigned char k = 0; k < count; k++) {
+      unsigned char led = data[k];
+      unsigned char level = (data[count + k / 2] >> (k & 1 ? 4 : 0)) & 0x0F;
+      if (led >= LED_NUM_ROWS * LED_NUM_COLS) {
+        return false;
+      }
+      for (unsigned char plane = 0; plane < LED_NUM_PLANES; plane++) {
+        unsigned char &bits = entry->frame.planes[plane].bits[led >> 3];
+        if (level & (1 << plane)) {
+          bits |= 1 << (led & 7);
+        } else {
+          bits &= ~(1 << (led & 7));
+        }
+      }
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+  return true;
+}
+
+#endif  // LedShow_h
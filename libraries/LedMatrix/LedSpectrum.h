@@ -0,0 +1,170 @@
+/*
+ * LedSpectrum.h
+ *
+ * A bar graph of the sound playing, one bar per column, worked out from the
+ * PCM data WaveHC has just read into its play buffer.
+ *
+ * Copyright 2009 Eric Z. Ayers
+ *
+ * License: Creative Commons Attribution 3.0
+ *          See LICENSE file for more details
+ *
+ * Analyze() takes one refill, WaveHC::lastRefill(), as it is: 8 bit
+ * unsigned or 16 bit signed little endian samples, channels interleaved.
+ * Every 4 bytes are averaged into one point, which mixes stereo down to
+ * mono and low-pass filters a little, so a full 256 byte buffer gives 64
+ * points whatever the format.  The points come at
+ *
+ *   rate * channels * bytes per sample / 4
+ *
+ * a second: 11025 for a 22kHz 16 bit mono file, 5512 for 8 bit mono.
+ *
+ * Each column is a Goertzel filter on one bin of a 64 point DFT of those
+ * points, bins 1, 2, 3, 5, 8, 12, 18 and 27, roughly a third of an octave
+ * apart at the low end and wider at the top.  With fewer than 8 columns
+ * the bins are spread over the same range.  At 11025 points a second bin
+ * k is k * 172Hz, so 6 columns show 172Hz to 4.6kHz.  Shorter buffers, the
+ * last one of a file, are analyzed over what there is.
+ *
+ * Everything is 16 bit fixed point with the coefficients in Q14; there's
+ * no floating point on the device.  A bar is one row per 3dB of bin power
+ * with the top row LED_SPECTRUM_TOP_BITS, about full scale.  Bars rise at
+ * once and fall a row each time Analyze() is called.
+ *
+ * The work is 64 adds for the points and 64 multiplies per column, about
+ * 20,000 cycles, 1ms at 20MHz, for 6 columns.  It doesn't touch the
+ * buffers' owner, so it can run in loop() between refills; the sketch
+ * times each call.
+ */
+
+#ifndef LedSpectrum_h
+#define LedSpectrum_h
+
+#include <stdint.h>
+#include <string.h>
+#include "LedMatrix.h"
+
+// Points per analysis, one for every 4 bytes of a 256 byte play buffer
+#define LED_SPECTRUM_POINTS 64
+
+// Bits of bin power that fill a column.  A full scale sine on a bin
+// gives 23.
+#ifndef LED_SPECTRUM_TOP_BITS
+#define LED_SPECTRUM_TOP_BITS 21
+#endif
+
+#define LED_SPECTRUM_BINS 8
+
+// DFT bins of the columns and 2cos(2pi k/64) in Q14 for each
+static const unsigned char kLedSpectrumBin[LED_SPECTRUM_BINS] = {
+  1, 2, 3, 5, 8, 12, 18, 27
+};
+static const int16_t kLedSpectrumCoeff[LED_SPECTRUM_BINS] = {
+  32610, 32138, 31357, 28899, 23170, 12540, -6393, -28899
+};
+
+template <int Rows, int Cols>
+class LedSpectrumT {
+ public:
+  typedef LedFrameT<Rows, Cols> Frame;
+
+  LedSpectrumT() { Clear(); }
+
+  // All bars down
+  void Clear() { memset(heights_, 0, sizeof(heights_)); }
+
+  // Update the bars from one buffer of bits_per_sample PCM data
+  void Analyze(const uint8_t *data, uint16_t len,
+               unsigned char bits_per_sample);
+
+  // Draw the bars up from the last row, the top LED of each at level and
+  // the rest at a quarter of it.  level is 0-15, as from
+  // LedMatrixBase::Level().
+  void Render(unsigned char level, Frame *frame) const;
+
+ private:
+  static unsigned char BitLength(uint32_t value);
+
+  unsigned char heights_[Cols];
+};
+
+// Bars for the ElectricPlunger's matrix
+typedef LedSpectrumT<LED_NUM_ROWS, LED_NUM_COLS> LedSpectrum;
+
+template <int Rows, int Cols>
+unsigned char LedSpectrumT<Rows, Cols>::BitLength(uint32_t value) {
+  unsigned char bits = 0;
+  while (value) {
+    value >>= 1;
+    ++bits;
+  }
+  return bits;
+}
+
+template <int Rows, int Cols>
+void LedSpectrumT<Rows, Cols>::Analyze(const uint8_t *data, uint16_t len,
+                                       unsigned char bits_per_sample) {
+  // Mix down to points of +-64.  Only the high byte of a 16 bit sample is
+  // used.
+  int8_t points[LED_SPECTRUM_POINTS];
+  unsigned char count = len / 4 < LED_SPECTRUM_POINTS
+      ? len / 4 : LED_SPECTRUM_POINTS;
+  for (unsigned char i = 0; i < count; ++i, data += 4) {
+    if (bits_per_sample == 16) {
+      int sum = (int8_t)data[1] + (int8_t)data[3];
+      points[i] = sum >> 2;
+    } else {
+      int sum = data[0] + data[1] + data[2] + data[3] - 4 * 0X80;
+      points[i] = sum >> 3;
+    }
+  }
+
+  for (unsigned char col = 0; col < Cols; ++col) {
+    unsigned char bin =
+        Cols > 1 ? col * (LED_SPECTRUM_BINS - 1) / (Cols - 1) : 0;
+    int16_t coeff = kLedSpectrumCoeff[bin];
+    // s[n] = x[n] + coeff s[n-1] - s[n-2], which stays under 21000 for
+    // points of +-64 on bin 1 and less on the others
+    int16_t s1 = 0;
+    int16_t s2 = 0;
+    for (unsigned char i = 0; i < count; ++i) {
+      int16_t s0 = points[i] + (int16_t)(((int32_t)coeff * s1) >> 14) - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    int32_t power = (int32_t)s1 * s1 + (int32_t)s2 * s2
+        - (int32_t)(int16_t)(((int32_t)coeff * s1) >> 14) * s2;
+    int bits = power > 0 ? BitLength(power) : 0;
+    int height = bits - (LED_SPECTRUM_TOP_BITS - Rows);
+    if (height < 0) {
+      height = 0;
+    } else if (height > Rows) {
+      height = Rows;
+    }
+    if (height >= heights_[col]) {
+      heights_[col] = height;
+    } else {
+      --heights_[col];
+    }
+  }
+}
+
+template <int Rows, int Cols>
+void LedSpectrumT<Rows, Cols>::Render(unsigned char level,
+                                      Frame *frame) const {
+  memset(frame, 0, sizeof(*frame));
+  unsigned char dim = level >> 2 ? level >> 2 : 1;
+  for (int col = 0; col < Cols; ++col) {
+    for (int i = 0; i < heights_[col]; ++i) {
+      int led = (Rows - 1 - i) * Cols + col;
+      unsigned char value = i == heights_[col] - 1 ? level : dim;
+      for (int plane = 0; plane < LED_NUM_PLANES; ++plane) {
+        if (value & (1 << plane)) {
+          frame->planes[plane].bits[led >> 3] |= 1 << (led & 7);
+        }
+      }
+    }
+  }
+}
+
+#endif  // LedSpectrum_h
@@ -119,6 +119,7 @@ uint8_t FatReader::open(FatVolume &vol, dir_t &dir)
     return 0;
   }
   vol_ = &vol;
+  contiguous_ = 0;
   rewind();
   return 1;
 }
@@ -148,9 +149,36 @@ uint8_t FatReader::openRoot(FatVolume &vol)
     return 0;
   }
   vol_ = &vol;
+  contiguous_ = 0;
   rewind();
   return 1;
 }
+/**
+ * Check whether the clusters of an open file follow one another on the
+ * volume.  If they do, later seeks compute the cluster from the read
+ * position instead of following the cluster chain, so a seek to any
+ * position in the file costs no reads.
+ *
+ * \return The value one, true, is returned if the file is contiguous and
+ * the value zero, false, is returned if it is not, it is not a file or an
+ * I/O error occurred.
+ */
+uint8_t FatReader::checkContiguous(void)
+{
+  contiguous_ = 0;
+  if (!isFile()) return 0;
+  uint8_t bpc = vol_->blocksPerCluster();
+  uint32_t nc = (((fileSize_ + 511) >> 9) + bpc - 1)/bpc;
+  uint32_t cluster = firstCluster_;
+  for (uint32_t i = 1; i < nc; i++) {
+    BUSY_LOOP;
+    uint32_t next = vol_->nextCluster(cluster);
+    if (next != cluster + 1) return 0;
+    cluster = next;
+  }
+  contiguous_ = 1;
+  return 1;
+}
 /**
  * Read data from a file at starting at the current read position.
  * 
@@ -242,7 +270,10 @@ uint8_t FatReader::seekCur(uint32_t offset)
   uint32_t nc = (newPos >> 9)/vol_->blocksPerCluster()
                  - (readPosition_ >> 9)/vol_->blocksPerCluster();
   readPosition_ = newPos;
-  if (type_ != FAT_READER_TYPE_ROOT16) {
+  if (contiguous_) {
+    readCluster_ = firstCluster_ + (newPos >> 9)/vol_->blocksPerCluster();
+  }
+  else if (type_ != FAT_READER_TYPE_ROOT16) {
     while (nc-- != 0) {
       BUSY_LOOP;
       if (!(readCluster_ = vol_->nextCluster(readCluster_))) return 0;
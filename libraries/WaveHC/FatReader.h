@@ -122,6 +122,7 @@ class FatReader {
 /** Test value for directory type */
 #define FAT_READER_TYPE_MIN_DIR FAT_READER_TYPE_ROOT16
   uint8_t type_;
+  uint8_t contiguous_;
   uint32_t fileSize_;
   uint32_t readCluster_;  
   uint32_t readPosition_;
@@ -131,7 +132,8 @@ class FatReader {
   void (*busyFunc_)();
 public:
 /** Create an instance of FatReader. */
-  FatReader(void) : type_(FAT_READER_TYPE_CLOSED) {}
+  FatReader(void) : type_(FAT_READER_TYPE_CLOSED), contiguous_(0) {}
+  uint8_t checkContiguous(void);
   uint8_t openRoot(FatVolume &vol);
   uint8_t open(FatVolume &vol, dir_t &dir);
   uint8_t open(FatReader &dir, char *name);
@@ -146,6 +148,8 @@ public:
   uint32_t fileSize(void) {return fileSize_;}
   /** \return The first cluster number for a file or directory. */
   uint32_t firstCluster(void) {return firstCluster_;}
+  /** \return True if checkContiguous() found the file contiguous. */
+  uint8_t isContiguous(void) {return contiguous_;}
   /** \return True if this is a FatReader for a directory else false */
   uint8_t isDir(void) {return type_ >= FAT_READER_TYPE_MIN_DIR;}
   /** \return True if this is a FatReader for a file else false */
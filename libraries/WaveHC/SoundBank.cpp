@@ -0,0 +1,129 @@
+/* Arduino WaveHC Library
+ * Copyright (C) 2009 by Eric Z. Ayers
+ *
+ * This file is part of the Arduino WaveHC Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino WaveHC Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "SoundBank.h"
+#include "WaveUtil.h"
+
+#define DEBUG 0
+
+/**
+ * Use an open file as a sound bank.  The header is checked and the file's
+ * cluster chain is walked once so that starting a clip is a computed seek.
+ * The first \a size entries of the table are read into \a table, so those
+ * clips start without reading the card for their entry.
+ *
+ * \param[in] f An open FatReader for the bank file.  It must stay open
+ * while the bank is in use and is shared by every clip.
+ *
+ * \param[in] table Optional array for the table of clips.  It must stay
+ * valid while the bank is in use.
+ *
+ * \param[in] size The number of entries \a table holds.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t SoundBank::open(FatReader &f, SoundBankEntry *table, uint16_t size)
+{
+  SoundBankHeader header;
+
+  file_ = 0;
+  count_ = 0;
+  cached_ = 0;
+  if (!f.seekSet(0) || f.read((uint8_t *)&header, sizeof(header)) != sizeof(header)
+      || strncmp(header.magic, SOUND_BANK_MAGIC, 4)
+      || header.version != SOUND_BANK_VERSION) {
+#if DEBUG > 0
+    putstring_nl("Not a sound bank");
+#endif
+    return 0;
+  }
+#if DEBUG > 0
+  if (!f.checkContiguous()) {
+    putstring_nl("Sound bank is fragmented");
+  }
+#else
+  // a fragmented bank still plays, its seeks just follow the chain
+  f.checkContiguous();
+#endif
+  if (size > header.count) size = header.count;
+  if (table && size) {
+    // the table follows the header, where the read above left off
+    int16_t n = size*sizeof(SoundBankEntry);
+    if (f.read((uint8_t *)table, n) != n) return 0;
+    table_ = table;
+    cached_ = size;
+  }
+  file_ = &f;
+  count_ = header.count;
+  return 1;
+}
+/**
+ * Read the location and format of a clip, from the table given to open()
+ * if it holds the clip and from the card if not.
+ *
+ * \param[in] index The clip number, zero for the first clip.
+ * \param[out] info Where the clip is in the bank file, for
+ * WaveHC::create(f, info).
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t SoundBank::getInfo(uint16_t index, WaveInfo &info)
+{
+  SoundBankEntry entry;
+
+  if (!file_ || index >= count_) return 0;
+  if (index < cached_) {
+    entry = table_[index];
+  } else {
+    uint32_t pos = sizeof(SoundBankHeader) + (uint32_t)index*sizeof(entry);
+    if (!file_->seekSet(pos)
+        || file_->read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) {
+      return 0;
+    }
+  }
+  info.dataOffset = entry.offset;
+  info.dataSize = entry.length;
+  info.sampleRate = entry.sampleRate;
+  info.channels = entry.channels;
+  info.bitsPerSample = entry.bitsPerSample;
+  return 1;
+}
+/**
+ * Start playing a clip.  Any file \a wave is playing is stopped first.
+ *
+ * \param[in] wave The player to use.
+ * \param[in] index The clip number, zero for the first clip.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t SoundBank::play(WaveHC &wave, uint16_t index)
+{
+  WaveInfo info;
+
+  if (wave.isplaying) wave.stop();
+  if (!getInfo(index, info) || !wave.create(*file_, info)) return 0;
+  // the next clip follows this one's data, it isn't another chunk
+  wave.lastChunk = 1;
+  wave.play();
+  return 1;
+}
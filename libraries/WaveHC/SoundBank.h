@@ -0,0 +1,83 @@
+/* Arduino WaveHC Library
+ * Copyright (C) 2009 by Eric Z. Ayers
+ *
+ * This file is part of the Arduino WaveHC Library
+ *
+ * This Library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This Library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with the Arduino WaveHC Library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*
+ * A sound bank is one file holding many clips, so a clip can be started
+ * by number without searching a directory or parsing a RIFF header.
+ * Banks are built from .wav files by host_tools/mkbank.
+ *
+ * Layout, all values little endian:
+ *
+ *   SoundBankHeader   magic "SBNK", version, number of clips
+ *   SoundBankEntry    one per clip: offset and length of its PCM data,
+ *                     sample rate, channels and bits per sample
+ *   PCM data          each clip starts on a SOUND_BANK_ALIGN boundary
+ *
+ * open() can copy the table, or its first entries, into an array the
+ * sketch provides.  A clip in the array starts with one seek to its data;
+ * any other clip reads its entry from the card first.  Each entry takes
+ * sizeof(SoundBankEntry) bytes of RAM, so a sketch short of RAM can give
+ * a table for its most used clips only, or none.
+ */
+#ifndef SoundBank_h
+#define SoundBank_h
+
+#include "FatReader.h"
+#include "WaveHC.h"
+
+/** First four bytes of a sound bank file */
+#define SOUND_BANK_MAGIC "SBNK"
+/** Format version written by mkbank */
+#define SOUND_BANK_VERSION 1
+/** Clip data starts on a multiple of this many bytes */
+#define SOUND_BANK_ALIGN 512
+
+struct SoundBankHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t count;         // number of SoundBankEntry records that follow
+};
+
+struct SoundBankEntry {
+  uint32_t offset;        // file position of the clip's first PCM byte
+  uint32_t length;        // length of the clip in bytes
+  uint32_t sampleRate;
+  uint8_t channels;
+  uint8_t bitsPerSample;
+  uint16_t reserved;
+};
+
+class SoundBank {
+  FatReader *file_;
+  SoundBankEntry *table_;
+  uint16_t count_;
+  uint16_t cached_;
+ public:
+  /** Create an instance of SoundBank. */
+  SoundBank(void) : file_(0), table_(0), count_(0), cached_(0) {}
+  /** \return The number of clips in the bank. */
+  uint16_t count(void) {return count_;}
+  /** \return The number of clips whose entries are held in RAM. */
+  uint16_t cached(void) {return cached_;}
+  uint8_t getInfo(uint16_t index, WaveInfo &info);
+  uint8_t open(FatReader &f, SoundBankEntry *table = 0, uint16_t size = 0);
+  uint8_t play(WaveHC &wave, uint16_t index);
+};
+
+#endif //SoundBank_h
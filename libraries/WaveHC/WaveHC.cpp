@@ -24,19 +24,79 @@ uint8_t buffer1[PLAYBUFFLEN];
 uint8_t buffer2[PLAYBUFFLEN];
 uint8_t *playbuff, *doublebuff;     // pointers to the current audio buffer and back buffer
 uint8_t *currentpos, *endbuffpos;   // the current playing location and the end of the buffer
+uint8_t *emergencypos;  // past here the refill interrupt reads the back buffer
+// bytes of the play buffer left at emergencypos, see REFILL_EMERGENCY
+uint16_t emergencylen = PLAYBUFFLEN;
 
 volatile uint8_t fillingbuffer = 0;
 volatile uint8_t doublebuffready = 0;
+// set while loop() reads another file, see holdRefill()
+volatile uint8_t refillHeld = 0;
+// the back buffer as the last refill left it, see lastRefill()
+uint8_t *refillbuff = 0;
+uint16_t refilllen = 0;
+uint16_t refillCount = 0;
+// samples sent to the DAC since reset, never cleared between files
+volatile uint32_t sampleCount = 0;
 //uint16_t temp16;
 
 #define DEBUG 0
 
-#define DVOLUME 0
+// Apply WaveHC::volume and fades as each buffer is read from the card.
+#define DVOLUME 1
 
 #define OSX_BUG_FIX 0
 
+#if WAVE_ISR_PROFILE
+// cycle count at the last sample compare match, see profileClock()
+volatile uint32_t profileBase = 0;
+IsrProfile sampleProfile;
+IsrProfile refillProfile;
+IsrProfile pumpProfile;
+
+/*
+ * Cycles since TIMER1 was started, made from TCNT1 and the compare
+ * matches counted by the sample interrupt.  Call with interrupts disabled.
+ */
+static uint32_t profileClock(void)
+{
+  uint16_t t = TCNT1;
+  uint32_t base = profileBase;
+  // a compare match that the sample interrupt has not counted yet
+  if ((TIFR1 & _BV(OCF1A)) && t < (OCR1A >> 1)) base += OCR1A + 1;
+  return base + t;
+}
+
+/**
+ * Add one duration to a profile.
+ *
+ * \param[in,out] p The profile to update.
+ * \param[in] cycles The duration in CPU cycles.
+ */
+void profileRecord(IsrProfile *p, uint32_t cycles)
+{
+  uint8_t b = 0;
+  if (p->count == 0 || cycles < p->min) p->min = cycles;
+  if (cycles > p->max) p->max = cycles;
+  p->count++;
+  p->total += cycles;
+  for (uint32_t c = cycles >> 1; c && b < (ISR_PROFILE_BUCKETS - 1); c >>= 1) b++;
+  if (p->histogram[b] != 0XFFFF) p->histogram[b]++;
+}
+#define PROFILE_END(p, start) profileRecord(&p, profileClock() - (start))
+#else  //WAVE_ISR_PROFILE
+#define PROFILE_END(p, start)
+#endif //WAVE_ISR_PROFILE
+
 #define SECTORSIZE 512
 
+// The back buffer is normally refilled by WaveHC::pump() from loop().  If
+// this many bytes of the play buffer are left and it hasn't been, the
+// refill interrupt does it instead.  Until pump() is called for a file the
+// interrupt refills at the swap, so sketches that never call it keep the
+// whole buffer as their margin.
+#define REFILL_EMERGENCY (PLAYBUFFLEN/2)
+
 #if defined(__AVR_ATmega328P__)
 SIGNAL(TIMER1_COMPA_vect) {
 #else
@@ -56,10 +116,20 @@ SIGNAL(SIG_OUTPUT_COMPARE1A) {
 	::);
 #endif //OSX_BUG_FIX
 
+#if !WAVE_PWM_OUTPUT
   uint8_t t8, i;
+#endif //WAVE_PWM_OUTPUT
 
-  if (!playing) 
+#if WAVE_ISR_PROFILE
+  // TCNT1 was cleared by the compare match that got us here
+  profileBase += OCR1A + 1;
+  uint32_t start = profileBase;
+#endif //WAVE_ISR_PROFILE
+
+  if (!playing) {
+    PROFILE_END(sampleProfile, start);
     return;
+  }
 
 
   if (currentpos == endbuffpos) {
@@ -74,17 +144,28 @@ SIGNAL(SIG_OUTPUT_COMPARE1A) {
       }
       currentpos = playbuff;
       endbuffpos = playbuff + PLAYBUFFLEN;
-      doublebuffready = 0;
-      if (!fillingbuffer) {
-	TIMSK1 |= _BV(OCIE1B);   // fill the doublebuffer up
-      }
+      emergencypos = endbuffpos - emergencylen;
+      doublebuffready = 0;   // ask pump() to fill the doublebuffer up
     } else {
       playing->errors++;
+      PROFILE_END(sampleProfile, start);
       return;
     }
   }
+  if (currentpos >= emergencypos && !doublebuffready && !fillingbuffer) {
+    TIMSK1 |= _BV(OCIE1B);   // pump() is late, fill it from the interrupt
+  }
 
 
+#if WAVE_PWM_OUTPUT
+  // one register write, the top 8 bits as offset binary
+  if (playing->BitsPerSample == 16) {
+    pwm_write(currentpos[1] ^ 0x80);
+    currentpos += 2;
+  } else {
+    pwm_write(*currentpos++);
+  }
+#else //WAVE_PWM_OUTPUT
   // ok get ready to output data to the dac
   // do the THING
   /* this is the 'wrapped' version thats all pretty
@@ -122,18 +203,9 @@ SIGNAL(SIG_OUTPUT_COMPARE1A) {
   
   if (playing->BitsPerSample == 16) {
 
-#if DVOLUME
-    temp16= currentpos[1];
-    temp16 <<= 8;
-    temp16 |= currentpos[0];
-
-    temp16 ^= 0x8000;
-    temp16 >>= playing->volume;
-    t8 = temp16>>8;
-#else
+    // volume has already been applied by readWaveData()
     t8 = currentpos[1];
     t8 ^= 0x80;
-#endif
 
     for (i=0; i<8; i++) {
       if (t8 & 0x80)
@@ -145,11 +217,7 @@ SIGNAL(SIG_OUTPUT_COMPARE1A) {
       dac_clock_down();
     }
 
-#if DVOLUME
-    t8 = temp16&0xFF;
-#else
     t8 = currentpos[0];
-#endif
     for (i=0; i<4; i++) {
       if (t8 & 0x80)
 	DAC_DI_PORT |= _BV(DAC_DI);
@@ -184,6 +252,9 @@ SIGNAL(SIG_OUTPUT_COMPARE1A) {
   unselect_dac();
   dac_latch_down();
   dac_latch_up();  
+#endif //WAVE_PWM_OUTPUT
+  sampleCount++;
+  PROFILE_END(sampleProfile, start);
 
 #if OSX_BUG_FIX > 0
 // Work-around for avr-gcc 4.3 OSX version bug
@@ -222,9 +293,13 @@ SIGNAL(SIG_OUTPUT_COMPARE1B) {
 #endif //OSX_BUG_FIX	
 	
   uint16_t read;
+#if WAVE_ISR_PROFILE
+  uint32_t start = profileClock();
+#endif //WAVE_ISR_PROFILE
 
   TIMSK1 &= ~_BV(OCIE1B);   // turn off bufferfiller 
-  if (doublebuffready) { // we're not needed ??
+  // we're not needed, or the card is busy and the next sample asks again
+  if (doublebuffready || fillingbuffer || refillHeld) {
     return;
   }
 
@@ -240,6 +315,10 @@ SIGNAL(SIG_OUTPUT_COMPARE1B) {
   cli();
   fillingbuffer = 0;
   doublebuffready = 1;
+  refillbuff = doublebuff;
+  refilllen = (int16_t)read > 0 ? read : 0;
+  refillCount++;
+  PROFILE_END(refillProfile, start);
   sei();
   
 #if OSX_BUG_FIX > 0
@@ -258,7 +337,41 @@ SIGNAL(SIG_OUTPUT_COMPARE1B) {
 #endif //OSX_BUG_FIX
 }
 
-WaveHC::WaveHC(void) {
+WaveHC::WaveHC(void) : volume(WAVE_UNITY_GAIN), fadeSamples(0), chunkFunc(0) {
+}
+
+/*
+ * Read chunk headers until a data chunk is found, skipping all others
+ * after handing them to the chunk function, if any.  Leaves the file
+ * positioned at the first byte of the chunk's data.  If taken isn't null
+ * it is set when the chunk function used any of the chunks.
+ */
+static uint8_t findDataChunk(WaveHC *wav, uint8_t *taken = 0)
+{
+  uint8_t headerbuff[5];
+  if (taken) *taken = 0;
+  while (1) {
+    // read chunk ID
+    if (wav->fd->read(headerbuff, 4) != 4) return 0;
+    headerbuff[4] = 0;
+    if (wav->fd->read((uint8_t *)&wav->remainingBytesInChunk, 4) != 4) return 0;
+#if DEBUG > 0
+    Serial.print((char *)headerbuff);
+    putstring(" type, size=");
+    Serial.print(wav->remainingBytesInChunk, DEC);
+    putstring_nl("");
+#endif
+
+    if (!strncmp((char *)headerbuff, "data", 4)) return 1;
+    // MEME, if not "data" then skip it!
+    if (wav->chunkFunc) {
+      uint32_t used = (*wav->chunkFunc)(*wav->fd,
+          (char *)headerbuff, wav->remainingBytesInChunk);
+      if (used && taken) *taken = 1;
+      wav->remainingBytesInChunk -= used;
+    }
+    if (!wav->fd->seekCur(wav->remainingBytesInChunk)) return 0;
+  }
 }
 
 uint8_t WaveHC::create(FatReader &f)
@@ -356,15 +469,107 @@ uint8_t WaveHC::create(FatReader &f)
     return 0;
   }
 
-  remainingBytesInChunk = 0;
   fd = &f;
   errors = 0;
+  lastChunk = 0;
 
   isplaying = 0;
 
   // ok good now onto some goddamn data
+  uint32_t chunkOffset = f.readPosition();
+  uint8_t taken;
+  if (!findDataChunk(this, &taken)) {
+    putstring_nl("No data chunk");
+    return 0;
+  }
+  dataOffset = f.readPosition();
+  dataSize = remainingBytesInChunk;
+  if (taken) {
+    // the chunk function used chunks before the data, so a start from
+    // getInfo() begins with them too
+    dataOffset = chunkOffset;
+    dataSize = 0;
+  }
+  return 1;
+}
+/**
+ * Prepare a file for playback using a WaveInfo saved by getInfo().
+ *
+ * The RIFF header is not read.  The file is positioned at the first PCM
+ * byte with a single seek, or at the chunks before it that went to the
+ * chunk function, so the caller must make sure \a info still describes
+ * \a f.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t WaveHC::create(FatReader &f, const WaveInfo &info)
+{
+  if (!f.seekSet(info.dataOffset)) return 0;
+  Channels = info.channels;
+  dwSamplesPerSec = info.sampleRate;
+  BitsPerSample = info.bitsPerSample;
+  dataOffset = info.dataOffset;
+  dataSize = info.dataSize;
+  remainingBytesInChunk = info.dataSize;
+  lastChunk = 0;
+  fd = &f;
+  errors = 0;
+  isplaying = 0;
   return 1;
 }
+/** Save the data chunk location and format found by create(). */
+void WaveHC::getInfo(WaveInfo &info)
+{
+  info.dataOffset = dataOffset;
+  info.dataSize = dataSize;
+  info.sampleRate = dwSamplesPerSec;
+  info.channels = Channels;
+  info.bitsPerSample = BitsPerSample;
+}
+#if WAVE_ISR_PROFILE
+/** Start new sample and refill interrupt profiles. */
+void WaveHC::clearProfile(void)
+{
+  cli();
+  memset(&sampleProfile, 0, sizeof(sampleProfile));
+  memset(&refillProfile, 0, sizeof(refillProfile));
+  memset(&pumpProfile, 0, sizeof(pumpProfile));
+  sei();
+}
+/**
+ * Copy the interrupt profiles collected since the last clearProfile().
+ *
+ * \param[out] sample Timing of the sample (TIMER1 COMPA) interrupt.
+ * \param[out] refill Timing of the buffer refills done by the TIMER1 COMPB
+ * interrupt.
+ * \param[out] pump Timing of the buffer refills done by pump().
+ */
+void WaveHC::getProfile(IsrProfile &sample, IsrProfile &refill,
+                        IsrProfile &pump)
+{
+  cli();
+  sample = sampleProfile;
+  refill = refillProfile;
+  pump = pumpProfile;
+  sei();
+}
+#endif //WAVE_ISR_PROFILE
+/**
+ * Ramp the volume linearly from its current value to \a gain.
+ *
+ * \param[in] gain The final 8.8 fixed-point gain, WAVE_UNITY_GAIN is 1.0.
+ * \param[in] samples Length of the ramp in sample frames.  The gain is
+ * stepped once per buffer so the ramp resolution is one buffer.
+ */
+void WaveHC::fadeTo(uint16_t gain, uint32_t samples)
+{
+  cli();
+  fadeTarget = gain;
+  fadeSamples = samples;
+  if (samples == 0) volume = gain;
+  sei();
+}
 // return pause status
 uint8_t WaveHC::isPaused(void)
 {
@@ -396,6 +601,8 @@ void WaveHC::play(void) {
   //uart_putdw_dec(wav->fd->pos);
   
   // kickstart
+  playbuff = buffer1;
+  doublebuff = buffer2;
   currentpos = buffer1;
   read = readWaveData(playing, buffer1, 2);
   if (read <= 0)
@@ -405,16 +612,25 @@ void WaveHC::play(void) {
   if (read <= 0)
    return;
   endbuffpos += read;
+  emergencypos = endbuffpos;
+  emergencylen = PLAYBUFFLEN;
 
   // fill the double buffer
   read = readWaveData(playing, buffer2, PLAYBUFFLEN);
   doublebuffready = 1;
+  refillbuff = buffer2;
+  refilllen = read > 0 ? read : 0;
+  refillCount++;
 
   //putstring("\n\rNow pos: "); uart_putdw_dec(wav->fd->pos);
   
   // its official!
   isplaying = 1;
 
+#if WAVE_PWM_OUTPUT
+  pwm_init();
+#endif //WAVE_PWM_OUTPUT
+
   TCCR1A = 0;              // no pwm
   TCCR1B = _BV(WGM12) | _BV(CS10); // no clock div, CTC mode
   OCR1A = ticksPerSample; // make it go off 1ce per sample, no more than 22khz
@@ -425,28 +641,58 @@ void WaveHC::play(void) {
 }
 
 
+#if DVOLUME
+/*
+ * Scale a buffer of PCM data by the player's 8.8 fixed-point volume and
+ * advance any fade in progress.  This runs once per buffer in the refill
+ * path so the DAC interrupt never has to multiply.
+ */
+static void applyVolume(WaveHC *wav, uint8_t *buff, uint16_t len)
+{
+  uint16_t gain = wav->volume;
+  if (gain == WAVE_UNITY_GAIN && wav->fadeSamples == 0) return;
+
+  if (wav->BitsPerSample == 16) {
+    for (uint16_t i = 0; i + 1 < len; i += 2) {
+      int32_t s = (int16_t)(buff[i] | (buff[i + 1] << 8));
+      s = (s * gain) >> 8;
+      if (s > 32767) s = 32767;
+      else if (s < -32768) s = -32768;
+      buff[i] = s;
+      buff[i + 1] = s >> 8;
+    }
+  } else {
+    // 8-bit samples are unsigned with 0X80 as silence
+    for (uint16_t i = 0; i < len; i++) {
+      int16_t s = ((int16_t)buff[i] - 0X80);
+      s = ((int32_t)s * gain) >> 8;
+      if (s > 127) s = 127;
+      else if (s < -128) s = -128;
+      buff[i] = s + 0X80;
+    }
+  }
+
+  if (wav->fadeSamples) {
+    // step the gain by the fraction of the ramp this buffer covers
+    uint32_t n = len / ((wav->BitsPerSample >> 3) * wav->Channels);
+    if (n >= wav->fadeSamples) {
+      wav->volume = wav->fadeTarget;
+      wav->fadeSamples = 0;
+    } else {
+      int32_t delta = (int32_t)wav->fadeTarget - gain;
+      wav->volume = gain + delta * (int32_t)n / (int32_t)wav->fadeSamples;
+      wav->fadeSamples -= n;
+    }
+  }
+}
+#endif //DVOLUME
+
 int16_t readWaveData(WaveHC *wav, uint8_t *buff, uint16_t len) {
-  uint8_t headerbuff[5];
 #if DEBUG > 1
   putstring("*hacK "); uart_putdw_dec(len); putstring_nl("");
 #endif
   if (wav->remainingBytesInChunk == 0) {
-    while (1) {
-      // read chunk ID
-      if (wav->fd->read(headerbuff, 4) != 4) return 0;
-      headerbuff[4] = 0;
-      if (wav->fd->read((uint8_t *)&wav->remainingBytesInChunk, 4) != 4) return 0;
-#if DEBUG > 0
-      Serial.print((char *)headerbuff);
-      putstring(" type, size=");
-      Serial.print(wav->remainingBytesInChunk, DEC);
-      putstring_nl("");
-#endif
-
-      if (!strncmp((char *)headerbuff, "data", 4)) break;
-      // MEME, if not "data" then skip it!
-      if (!wav->fd->seekCur(wav->remainingBytesInChunk)) return 0;
-    }
+    if (wav->lastChunk || !findDataChunk(wav)) return 0;
   }
 
   if (len > SECTORSIZE) len = SECTORSIZE;
@@ -469,8 +715,113 @@ int16_t readWaveData(WaveHC *wav, uint8_t *buff, uint16_t len) {
   }
   
   wav->remainingBytesInChunk -= len;
+#if DVOLUME
+  applyVolume(wav, buff, len);
+#endif //DVOLUME
   return len;
 }
+/**
+ * Refill the back buffer if the sample interrupt has asked for it.
+ *
+ * Call this often from loop() while a file is playing.  The buffer is then
+ * read in the main program, where it can't preempt other interrupt driven
+ * work or stack up on whatever else is running.  Until pump() is first
+ * called for a file, the refill interrupt reads each buffer as soon as the
+ * buffers swap.  After that it only steps in if half of the play buffer is
+ * gone before pump() gets to it, see refillDeadline().
+ *
+ * \return The value one, true, is returned if data was read and
+ * the value zero, false, is returned if there was nothing to do.
+ */
+uint8_t WaveHC::pump(void)
+{
+  cli();
+  if (playing != this) {
+    sei();
+    return 0;
+  }
+  emergencylen = REFILL_EMERGENCY;
+  if (doublebuffready || fillingbuffer) {
+    sei();
+    return 0;
+  }
+  fillingbuffer = 1;
+  TIMSK1 &= ~_BV(OCIE1B);   // cancel a late refill interrupt
+#if WAVE_ISR_PROFILE
+  uint32_t start = profileClock();
+#endif //WAVE_ISR_PROFILE
+  sei();
+
+  int16_t read = readWaveData(this, doublebuff, PLAYBUFFLEN);
+  if (read <= 0) {
+    stop();
+  }
+  cli();
+  fillingbuffer = 0;
+  doublebuffready = 1;
+  refillbuff = doublebuff;
+  refilllen = read > 0 ? read : 0;
+  refillCount++;
+  PROFILE_END(pumpProfile, start);
+  sei();
+  return 1;
+}
+/**
+ * Keep the refill interrupt off the card while loop() reads another file
+ * with interrupts enabled.  A refill that comes due meanwhile is retried
+ * at each sample until releaseRefill(), so the hold should be no longer
+ * than the rest of the play buffer lasts.  Call pump() first to make that
+ * likely.
+ */
+void WaveHC::holdRefill(void)
+{
+  refillHeld = 1;
+}
+/** Let the refill interrupt read the card again, see holdRefill(). */
+void WaveHC::releaseRefill(void)
+{
+  refillHeld = 0;
+}
+/**
+ * The PCM data read by the latest refill, for code that follows the audio
+ * as it plays, such as a level meter.  The data is as the DAC will get it,
+ * after volume.  It plays after the buffer now playing and isn't written
+ * again until it has played, so it can be read for at least one buffer's
+ * play time after the count changes.  Don't read it once the file has
+ * stopped; the next play() reuses the buffers.
+ *
+ * \param[out] data Set to the first byte.
+ * \param[out] len Set to the number of bytes, zero if the read failed.
+ *
+ * \return The number of refills since reset, which wraps.  A change means
+ * there is new data.
+ */
+uint16_t WaveHC::lastRefill(const uint8_t *&data, uint16_t &len)
+{
+  cli();
+  data = refillbuff;
+  len = refilllen;
+  uint16_t rtn = refillCount;
+  sei();
+  return rtn;
+}
+/**
+ * \return The number of samples that can be played before the refill
+ * interrupt takes over from pump(), zero if it already has, or 0XFFFF if
+ * there is nothing to refill.  A loop that does other long jobs can use
+ * this to call pump() first only when it must.
+ */
+uint16_t WaveHC::refillDeadline(void)
+{
+  uint16_t n = 0XFFFF;
+  cli();
+  if (playing == this && !doublebuffready && !fillingbuffer) {
+    n = currentpos < emergencypos ? emergencypos - currentpos : 0;
+    if (BitsPerSample == 16) n >>= 1;
+  }
+  sei();
+  return n;
+}
 
 void WaveHC::resume(void)
 {
@@ -480,6 +831,21 @@ void WaveHC::resume(void)
   sei();
 }
 
+/**
+ * Count of samples sent to the DAC by all files since reset.
+ *
+ * The count is kept by the DAC interrupt and only advances while a file is
+ * playing, so it is a clock that runs in step with the audio.  For stereo
+ * files each channel counts as one sample.  It wraps after 2^32 samples,
+ * so compare counts by subtraction.
+ */
+uint32_t WaveHC::samplesPlayed(void)
+{
+  cli();
+  uint32_t rtn = sampleCount;
+  sei();
+  return rtn;
+}
 void WaveHC::seek(uint32_t pos)
 {
   pos -= pos % PLAYBUFFLEN;
@@ -493,6 +859,14 @@ void WaveHC::seek(uint32_t pos)
   }
   sei();
 }
+/**
+ * Set the 8.8 fixed-point playback gain and cancel any fade in progress.
+ * The new gain takes effect with the next buffer read from the card.
+ */
+void WaveHC::setVolume(uint16_t gain)
+{
+  fadeTo(gain, 0);
+}
 void WaveHC::setSampleRate(uint32_t samplerate) 
 {
     while (TCNT0 != 0);
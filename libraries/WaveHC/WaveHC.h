@@ -14,17 +14,113 @@
 
 #include "FatReader.h"
 
+/** Unity gain for WaveHC::volume, an unsigned 8.8 fixed-point value */
+#define WAVE_UNITY_GAIN 0X100
+
+/**
+ * Set nonzero to time the TIMER1 interrupts and the refills done by
+ * WaveHC::pump().  The results are read with WaveHC::getProfile().
+ * Timing adds up to about 300 cycles to each.
+ */
+#ifndef WAVE_ISR_PROFILE
+#define WAVE_ISR_PROFILE 0
+#endif
+
+/**
+ * Set nonzero to play through Timer2 PWM on digital pin 3 (OC2B) instead
+ * of the DAC.  Each sample is one register write instead of a 16 bit
+ * serial transfer, but only its top 8 bits are played.  Pin 3 needs an
+ * RC low-pass filter before the amplifier.  Timer2 then belongs to WaveHC,
+ * so tone(), analogWrite() on pins 3 and 11 and LedMatrix's refresh timer
+ * can't be used.
+ */
+#ifndef WAVE_PWM_OUTPUT
+#define WAVE_PWM_OUTPUT 0
+#endif
+
+/** Number of power-of-two buckets in IsrProfile::histogram */
+#define ISR_PROFILE_BUCKETS 16
+
+/**
+ * Durations of one TIMER1 interrupt or pump() refill in CPU cycles.
+ * Sample interrupts are timed from the compare match, so interrupt latency
+ * is included.  Refill times are wall time and include the sample
+ * interrupts that nest in them.  A refill interrupt with nothing to do
+ * isn't counted.
+ * Bucket n of the histogram counts durations from 2^n to 2^(n+1) - 1
+ * cycles; the last bucket also holds anything longer.  total is the sum
+ * of all durations and wraps after 2^32 cycles, about half an hour of
+ * sample interrupts at 20 MHz, so clear the profile between reports.
+ */
+struct IsrProfile {
+  uint32_t count;
+  uint32_t total;
+  uint32_t min;
+  uint32_t max;
+  uint16_t histogram[ISR_PROFILE_BUCKETS];
+};
+#if WAVE_ISR_PROFILE
+void profileRecord(IsrProfile *p, uint32_t cycles);
+#endif //WAVE_ISR_PROFILE
+
+/**
+ * Location and format of the PCM data in a WAV file.  Save this after
+ * WaveHC::create(f) and pass it to WaveHC::create(f, info) to start the same
+ * file again without parsing its RIFF header.
+ */
+struct WaveInfo {
+  uint32_t dataOffset;    // file position of the first PCM byte
+  uint32_t dataSize;      // length of the data chunk in bytes, or zero if
+                          // dataOffset is the chunk header after fmt
+  uint32_t sampleRate;
+  uint8_t channels;
+  uint8_t bitsPerSample;
+};
+
+/**
+ * A function given the chunks of a file that aren't "data" or "fmt ", see
+ * WaveHC::setChunkFunc().
+ */
+typedef uint32_t (*WaveChunkFunc)(FatReader &f, const char *id,
+                                  uint32_t size);
+
 class WaveHC {
  public:
   WaveHC(void);
   uint8_t create(FatReader &f);
+  uint8_t create(FatReader &f, const WaveInfo &info);
+  void fadeTo(uint16_t gain, uint32_t samples);
+  /** Ramp from silence to unity gain over \a samples sample frames. */
+  void fadeIn(uint32_t samples) {setVolume(0); fadeTo(WAVE_UNITY_GAIN, samples);}
+  /** Ramp from the current gain to silence over \a samples sample frames. */
+  void fadeOut(uint32_t samples) {fadeTo(0, samples);}
+  void getInfo(WaveInfo &info);
+  void holdRefill(void);
+#if WAVE_ISR_PROFILE
+  void clearProfile(void);
+  void getProfile(IsrProfile &sample, IsrProfile &refill, IsrProfile &pump);
+#endif //WAVE_ISR_PROFILE
   uint32_t getSize(void) {return fd->fileSize();}
   uint8_t isPaused(void);
+  uint16_t lastRefill(const uint8_t *&data, uint16_t &len);
   void pause(void);
   void play(void);
+  uint8_t pump(void);
+  uint16_t refillDeadline(void);
+  void releaseRefill(void);
   void resume(void);
+  uint32_t samplesPlayed(void);
   void seek(uint32_t pos);
+  /**
+   * Hand each chunk after the fmt chunk that isn't "data" to \a func, with
+   * the file at its first byte, instead of skipping it.  \a func returns
+   * the number of bytes it read, and the rest of the chunk is skipped.
+   * Chunks between data chunks are met by the refill, so \a func may be
+   * called from the refill interrupt.
+   */
+  void setChunkFunc(WaveChunkFunc func) {chunkFunc = func;}
   void setSampleRate(uint32_t samplerate);
+  void setVolume(uint16_t gain);
   void stop(void);
   
   uint8_t Channels;
@@ -32,10 +128,18 @@ class WaveHC {
 //  uint16_t wBlockAlign;
   uint8_t BitsPerSample;
   uint32_t remainingBytesInChunk;
+  uint8_t lastChunk;  // end playback with this chunk, don't look for more
+  uint32_t dataOffset;
+  uint32_t dataSize;
 //  uint32_t chunkSize;
   volatile uint8_t isplaying;
   uint32_t errors;
+  // 8.8 fixed-point gain applied to each buffer as it is read from the card
+  uint16_t volume;
+  uint16_t fadeTarget;
+  uint32_t fadeSamples; // sample frames left in the current ramp
   FatReader* fd;
+  WaveChunkFunc chunkFunc;
 };
 
 int16_t readWaveData(WaveHC *wav, uint8_t *buff, uint16_t len);
@@ -2,7 +2,9 @@
 #define WaveUtil_h
 void ROM_putstring(const char *str);
 void ROM_putstringnl(const char *str);
+#ifndef UINT16_MAX
 #define UINT16_MAX 65535U
+#endif
 #define putstring(x) ROM_putstring(PSTR(x))
 #define putstring_nl(x) ROM_putstringnl(PSTR(x))
 #define nop asm volatile ("nop\n\t")
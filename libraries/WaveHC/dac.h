@@ -36,3 +36,17 @@
 
 void dac_init(void);
 void dac_send_val(uint16_t v);
+
+// PWM output for boards without the DAC, see WAVE_PWM_OUTPUT in WaveHC.h.
+// Timer2 runs fast PWM with no prescaler, a 78 kHz carrier at 20 MHz, and
+// drives OC2B on digital pin 3.
+#define PWM_OUT_DDR DDRD
+#define PWM_OUT PIND3
+
+#define pwm_init() do {\
+  PWM_OUT_DDR |= _BV(PWM_OUT);\
+  OCR2B = 0X80;\
+  TCCR2A = _BV(COM2B1) | _BV(WGM21) | _BV(WGM20);\
+  TCCR2B = _BV(CS20);\
+} while (0)
+#define pwm_write(v) OCR2B = (v)